@@ -9,6 +9,8 @@ import re
 import tempfile
 import sqlite3
 import time
+import bisect
+import zlib
 from datetime import datetime
 
 # ANSI color codes for dmesg-like output
@@ -29,9 +31,66 @@ INACTIVITY_THRESHOLD = 8.0  # seconds
 LOG_DIR = "logs"
 OVERWRITE_LOG = False  # Set to True to overwrite existing log files
 
+FRAME_MAGIC = 0x4E435251   # "QRCN": magic, size, dict_id, flags
+LEGACY_MAGIC = 0x5A535444  # "ZSTD": magic, size
+FRAME_HEADER = struct.Struct("<IIHBB")  # magic, size, dict_id, flags, codec
+LEGACY_HEADER = struct.Struct("<II")
+STREAM_HEADER = struct.Struct("<HIH")  # seq, offset, stream id; follows FRAME_HEADER in stream mode
+TILE_HEADER = struct.Struct("<H")  # seq; follows FRAME_HEADER in tiled mode
+FRAME_STREAM = 1 << 0
+FRAME_STREAM_END = 1 << 1
+FRAME_RECORDS = 1 << 2  # Column-packed records, see unpack_records()
+FRAME_PRINTK = 1 << 3   # Records carry printk index references
+FRAME_TRACE = 1 << 4    # Records carry call trace addresses
+FRAME_TILE = 1 << 5     # TILE_HEADER follows FRAME_HEADER
+FRAME_FLAGS = FRAME_STREAM | FRAME_STREAM_END | FRAME_RECORDS | FRAME_PRINTK | FRAME_TRACE | FRAME_TILE
+REF_TEXT = 0    # What a packed line holds: text,
+REF_TRACE = 1   # a call trace frame,
+REF_FORMAT = 2  # or a printk index reference (+ ID)
+RECORD_RAW = 0xFF       # Level of a line kept verbatim
+CODEC_ZSTD = 0
+CODEC_LZ4 = 1  # LZ4 block, from the LZ4 or LZ4HC backend
+ZDICT_MAGIC = 0xEC30A437
+# Dictionary matching the module's qrcon_dict.h, see train_dict.py
+DICT_PATH = os.environ.get("QRCON_DICT",
+                           os.path.join(os.path.dirname(os.path.abspath(__file__)), "qrcon.dict"))
+# Copy of /sys/kernel/debug/printk/index/vmlinux from the kernel that panicked
+PRINTK_INDEX_PATH = os.environ.get("QRCON_PRINTK_INDEX",
+                                   os.path.join(os.path.dirname(os.path.abspath(__file__)), "printk_index"))
+# printf conversions as the module parses them (qrcon_pi_spec), %p with its extensions
+CONVERSION_RE = re.compile(rb'%[-+ #0]*(?:\*|\d*)(?:\.(?:\*|\d*))?[hlLqjzt]*(?:([diuxXcso])|p[A-Za-z0-9]*)')
+ESCAPES = {ord('n'): b'\n', ord('t'): b'\t', ord('r'): b'\r', ord('f'): b'\f', ord('v'): b'\v',
+           ord('a'): b'\a', ord('e'): b'\x1b', ord('"'): b'"', ord('\\'): b'\\'}
+printk_index = None
+# System.map of the kernel that panicked, to symbolize call traces
+SYSTEM_MAP_PATH = os.environ.get("QRCON_SYSTEM_MAP",
+                                 os.path.join(os.path.dirname(os.path.abspath(__file__)), "System.map"))
+system_map = None
 
-def decode_qrcon_data(data):
-    """Decode ZSTD compressed data. Accepts a hex string or binary data."""
+
+def load_dict(dict_id):
+    """Return the path of the dictionary with the given ID, or None."""
+    try:
+        with open(DICT_PATH, 'rb') as f:
+            head = f.read(8)
+    except OSError as e:
+        print(f"Error: Frame needs dictionary {dict_id}, cannot read {DICT_PATH}: {e}")
+        return None
+    if len(head) < 8:
+        print(f"Error: {DICT_PATH} is not a zstd dictionary")
+        return None
+    magic, file_id = struct.unpack("<II", head)
+    if magic != ZDICT_MAGIC:
+        print(f"Error: {DICT_PATH} is not a zstd dictionary")
+        return None
+    if file_id != dict_id:
+        print(f"Error: Frame needs dictionary {dict_id}, {DICT_PATH} has ID {file_id}")
+        return None
+    return DICT_PATH
+
+
+def parse_frame(data):
+    """Split a payload (hex string or binary) into its header fields and compressed data."""
     if isinstance(data, str):
         try:
             binary_data = binascii.unhexlify(data.strip())
@@ -41,27 +100,343 @@ def decode_qrcon_data(data):
     else:
         binary_data = data
 
-    if len(binary_data) < 8:
+    if len(binary_data) < LEGACY_HEADER.size:
         print("Error: Data too short, missing header")
         return None
 
-    magic, uncompressed_size = struct.unpack("<II", binary_data[:8])
-    if magic != 0x5A535444:
-        print(f"Error: Invalid magic number: 0x{magic:08X}, expected 0x5A535444")
+    frame = {'dict_id': 0, 'flags': 0, 'codec': CODEC_ZSTD}
+    magic, frame['size'] = LEGACY_HEADER.unpack_from(binary_data)
+    if magic == FRAME_MAGIC:
+        if len(binary_data) < FRAME_HEADER.size:
+            print("Error: Data too short, missing header")
+            return None
+        _, _, frame['dict_id'], frame['flags'], frame['codec'] = FRAME_HEADER.unpack_from(binary_data)
+        header_size = FRAME_HEADER.size
+        if frame['flags'] & FRAME_STREAM:
+            if len(binary_data) < header_size + STREAM_HEADER.size:
+                print("Error: Data too short, missing stream header")
+                return None
+            frame['seq'], frame['offset'], frame['stream_id'] = STREAM_HEADER.unpack_from(binary_data, header_size)
+            header_size += STREAM_HEADER.size
+        elif frame['flags'] & FRAME_TILE:
+            if len(binary_data) < header_size + TILE_HEADER.size:
+                print("Error: Data too short, missing tile header")
+                return None
+            frame['seq'], = TILE_HEADER.unpack_from(binary_data, header_size)
+            header_size += TILE_HEADER.size
+    elif magic == LEGACY_MAGIC:
+        header_size = LEGACY_HEADER.size
+    else:
+        print(f"Error: Invalid magic number: 0x{magic:08X}, expected 0x{FRAME_MAGIC:08X}")
+        return None
+
+    frame['data'] = binary_data[header_size:]
+    return frame
+
+
+def lz4_block_decompress(src, size):
+    """Decompress a raw LZ4 block whose uncompressed size is known."""
+    dst = bytearray()
+    i = 0
+    while i < len(src):
+        token = src[i]
+        i += 1
+        # Literals
+        length = token >> 4
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        dst += src[i:i + length]
+        i += length
+        if i >= len(src):
+            break  # The last sequence has no match
+        # Match
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        if offset == 0 or offset > len(dst):
+            raise ValueError(f"invalid match offset {offset} at {i}")
+        length = token & 15
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        length += 4
+        start = len(dst) - offset
+        if offset >= length:
+            dst += dst[start:start + length]
+        else:
+            for k in range(length):  # Overlapping copy repeats the pattern
+                dst.append(dst[start + k])
+    if len(dst) != size:
+        raise ValueError(f"decoded {len(dst)} bytes, expected {size}")
+    return bytes(dst)
+
+
+def read_varint(data, i):
+    value = shift = 0
+    while True:
+        b = data[i]
+        i += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, i
+
+
+def unescape_format(text):
+    """Undo the escaping of formats in debugfs (seq_escape_printf_format)."""
+    out = bytearray()
+    i = 0
+    while i < len(text):
+        c = text[i]
+        i += 1
+        if c != ord('\\') or i == len(text):
+            out.append(c)
+        elif text[i] in ESCAPES:
+            out += ESCAPES[text[i]]
+            i += 1
+        elif 0x30 <= text[i] <= 0x37:
+            digits = re.match(rb'[0-7]{1,3}', text[i:i + 3]).group()
+            out.append(int(digits, 8) & 0xFF)
+            i += len(digits)
+        else:
+            out.append(c)
+    return bytes(out)
+
+
+def load_printk_index():
+    """Formats of the printk index by ID, i.e. by line in the debugfs file,
+    split into literal text and conversions. Cached after the first call."""
+    global printk_index
+    if printk_index is None:
+        printk_index = []
+        with open(PRINTK_INDEX_PATH, 'rb') as f:
+            for line in f:
+                if line.startswith(b'#'):
+                    continue
+                fmt = unescape_format(line.rstrip(b'\n').split(b' "', 1)[1][:-1])
+                if fmt.endswith(b'\n'):
+                    fmt = fmt[:-1]  # Records have no trailing newline
+                printk_index.append(split_format(fmt))
+    return printk_index
+
+
+def split_format(fmt):
+    """Split a format into literal bytes and conversion types: 'd', 'u',
+    'x' and 'X' are sent as numbers when possible, None is always text."""
+    parts = []
+    literal = bytearray()
+    i = 0
+    while i < len(fmt):
+        if fmt[i] != ord('%'):
+            literal.append(fmt[i])
+            i += 1
+        elif fmt[i + 1:i + 2] == b'%':
+            literal.append(ord('%'))
+            i += 2
+        else:
+            m = CONVERSION_RE.match(fmt, i)
+            if not m:  # Never referenced, the module cannot match it either
+                return None
+            parts.append(bytes(literal))
+            literal = bytearray()
+            kind = m.group(1)
+            parts.append({b'd': 'd', b'i': 'd', b'u': 'u', b'x': 'x', b'X': 'X'}.get(kind))
+            i = m.end()
+    parts.append(bytes(literal))
+    return parts
+
+
+def render_format(parts, args, i):
+    """Rebuild the text of a referenced record from its arguments at args[i:]."""
+    out = bytearray(parts[0])
+    for k in range(1, len(parts), 2):
+        kind = parts[k]
+        head, i = read_varint(args, i)
+        if kind is None:
+            out += args[i:i + head]
+            i += head
+        elif head & 1:
+            out += args[i:i + (head >> 1)]
+            i += head >> 1
+        else:
+            value = head >> 1
+            if kind == 'd':
+                value = -((value + 1) >> 1) if value & 1 else value >> 1
+            out += (b'%x' if kind == 'x' else b'%X' if kind == 'X' else b'%d') % value
+        out += parts[k + 1]
+    return bytes(out), i
+
+
+def load_system_map():
+    """Symbol addresses relative to _text, sorted, with their names.
+    Cached after the first call."""
+    global system_map
+    if system_map is None:
+        symbols = []
+        text = None
+        with open(SYSTEM_MAP_PATH, 'rb') as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) < 3 or fields[1] in (b'a', b'A', b'U', b'w', b'v'):
+                    continue
+                addr = int(fields[0], 16)
+                symbols.append((addr, fields[2]))
+                if fields[2] == b'_text':
+                    text = addr
+        if text is None:
+            raise ValueError(f"no _text in {SYSTEM_MAP_PATH}")
+        symbols.sort(key=lambda sym: sym[0])
+        system_map = ([addr - text for addr, _ in symbols], [name for _, name in symbols])
+    return system_map
+
+
+def render_trace(args, i):
+    """Symbolize a call trace frame written by qrcon_trace_put()."""
+    head, i = read_varint(args, i)
+    addr, i = read_varint(args, i)
+    size, i = read_varint(args, i)
+    name_hash = args[i]
+    i += 1
+    tail = b''
+    if head & 1:
+        length, i = read_varint(args, i)
+        tail = args[i:i + length]
+        i += length
+
+    addrs, names = load_system_map()
+    # The nearest symbol at or below the address with the right name, which
+    # skips aliases. The module only sends frames within their symbol.
+    k = bisect.bisect_right(addrs, addr) - 1
+    while k >= 0 and zlib.crc32(names[k]) & 0xFF != name_hash:
+        k -= 1
+    if k < 0 or addr - addrs[k] >= size:
+        raise ValueError(f"no symbol for _text+{addr:#x}, is {SYSTEM_MAP_PATH} from the same build?")
+    frame = b'%s+%#x/%#x' % (names[k], addr - addrs[k], size)
+    return b' ' * (head >> 2) + (b'? ' if head & 2 else b'') + frame + tail, i
+
+
+def unpack_records(data, seq_state, flags=0):
+    """Invert the module's record transform (qrcon_records_pack) back into
+    syslog lines, and report printk sequence gaps along the way."""
+    count, i = read_varint(data, 0)
+    levels = data[i:i + count]
+    i += count
+    stamps = []
+    usec = 0
+    for level in levels:
+        if level != RECORD_RAW:
+            delta, i = read_varint(data, i)
+            usec += (delta >> 1) ^ -(delta & 1)
+            stamps.append(usec)
+    seqs = []
+    for k in range(count):
+        value, i = read_varint(data, i)
+        seqs.append(value if k == 0 else seqs[-1] + value)
+    refs = [REF_TEXT] * count
+    if flags & FRAME_PRINTK:
+        entries, i = read_varint(data, i)
+        try:
+            index = load_printk_index()
+        except OSError as e:
+            raise ValueError(f"frame references the printk index, cannot read {PRINTK_INDEX_PATH}: {e}")
+        if len(index) != entries:
+            raise ValueError(f"printk index has {len(index)} formats, the module's had {entries}")
+    if flags & (FRAME_PRINTK | FRAME_TRACE):
+        for k in range(count):
+            refs[k], i = read_varint(data, i)
+        args_size, i = read_varint(data, i)
+        args = data[i:i + args_size]
+        arg_pos = 0
+        i += args_size
+    texts = data[i:].split(b'\n')
+    # The last line has no '\n' when the frame ends mid-line
+    complete = not texts[-1]
+    if complete:
+        texts.pop()
+    if len(texts) != count - sum(1 for ref in refs if ref):
+        raise ValueError(f"expected {count} lines of text, found {len(texts)}")
+
+    lines = []
+    stamp = iter(stamps)
+    text = iter(texts)
+    for k, (level, seq, ref) in enumerate(zip(levels, seqs, refs)):
+        if ref == REF_TRACE:
+            try:
+                line, arg_pos = render_trace(args, arg_pos)
+            except OSError as e:
+                raise ValueError(f"frame has call trace addresses, cannot read {SYSTEM_MAP_PATH}: {e}")
+            line += b'\n'
+        elif ref:
+            line, arg_pos = render_format(index[ref - REF_FORMAT], args, arg_pos)
+            line += b'\n'
+        else:
+            line = next(text)
+            if complete or k + 1 < count:
+                line += b'\n'
+        last = seq_state.get('last')
+        if last is not None and seq > last + 1:
+            print(f"Warning: {seq - last - 1} kernel messages lost before seq {seq}")
+        seq_state['last'] = seq
+        if level == RECORD_RAW:
+            lines.append(line)
+        else:
+            usec = next(stamp)
+            lines.append(b'<%d>[%5d.%06d] ' % (level, usec // 1000000, usec % 1000000) + line)
+    return b''.join(lines)
+
+
+def decompress_frame(frame, seq_state=None):
+    """Decompress a single independent frame with the codec it names."""
+    if frame['codec'] == CODEC_LZ4:
+        try:
+            data = lz4_block_decompress(frame['data'], frame['size'])
+        except (ValueError, IndexError) as e:
+            print(f"Error during LZ4 decompression: {e}")
+            return None
+    elif frame['codec'] == CODEC_ZSTD:
+        data = zstd_decompress(frame['data'], frame['dict_id'])
+        if data is None:
+            return None
+    else:
+        print(f"Error: Unknown codec {frame['codec']}")
         return None
 
-    print(f"Compressed data size: {len(binary_data) - 8} bytes")
-    print(f"Expected uncompressed size: {uncompressed_size} bytes")
+    if frame['flags'] & FRAME_RECORDS:
+        try:
+            data = unpack_records(data, {} if seq_state is None else seq_state, frame['flags'])
+        except (ValueError, IndexError, TypeError) as e:
+            print(f"Error unpacking records: {e}")
+            return None
+    return data.decode('utf-8', errors='replace')
+
+
+def zstd_decompress(compressed, dict_id, partial=False):
+    """Decompress a zstd frame with the CLI. With partial, return whatever
+    was decoded before an error (e.g. a stream with missing pieces)."""
+    command = ["zstd", "-d", "-c"]
+    if dict_id:
+        dict_path = load_dict(dict_id)
+        if not dict_path:
+            return None
+        command += ["-D", dict_path]
 
     temp_file = None
     try:
         with tempfile.NamedTemporaryFile(delete=False) as tmp:
-            tmp.write(binary_data[8:])
+            tmp.write(compressed)
             temp_file = tmp.name
-        result = subprocess.run([
-            "zstd", "-d", "-c", temp_file
-        ], capture_output=True, check=True)
-        return result.stdout.decode('utf-8', errors='replace')
+        result = subprocess.run(command + [temp_file], capture_output=True, check=not partial)
+        if result.returncode != 0:
+            print("Warning: Stream is incomplete, output is truncated")
+        return result.stdout
     except FileNotFoundError:
         print("Error: 'zstd' command not found. Please install zstd to decompress data.")
         return None
@@ -74,6 +449,121 @@ def decode_qrcon_data(data):
             os.unlink(temp_file)
 
 
+def split_payload(data):
+    """Split a payload into the frames it holds. Scanners that support Structured
+    Append hand back a whole series as one payload, its frames back to back.
+    Frames start with the magic; a match inside compressed data is only taken
+    as a frame when the header after it is plausible."""
+    if isinstance(data, str):
+        try:
+            data = binascii.unhexlify(data.strip())
+        except binascii.Error as e:
+            print(f"Error: Invalid hex data - {e}")
+            return []
+    magic = struct.pack("<I", FRAME_MAGIC)
+    starts = [0]
+    i = data.find(magic, 1)
+    while i != -1:
+        if i + FRAME_HEADER.size <= len(data):
+            _, _, _, flags, codec = FRAME_HEADER.unpack_from(data, i)
+            if codec in (CODEC_ZSTD, CODEC_LZ4) and not flags & ~FRAME_FLAGS:
+                starts.append(i)
+        i = data.find(magic, i + 1)
+    return [data[a:b] for a, b in zip(starts, starts[1:] + [len(data)])]
+
+
+def decode_qrcon_data(data):
+    """Decode ZSTD compressed data. Accepts a hex string or binary data."""
+    frame = parse_frame(data)
+    if not frame:
+        return None
+    if frame['flags'] & FRAME_STREAM:
+        print(f"Error: Frame is piece {frame['seq']} of a stream, decode it together with the others")
+        return None
+
+    print(f"Compressed data size: {len(frame['data'])} bytes")
+    print(f"Expected uncompressed size: {frame['size']} bytes")
+    return decompress_frame(frame)
+
+
+def decode_stream(pieces):
+    """Reassemble stream pieces by offset and decompress them as one frame.
+    Duplicate scans are dropped; decoding stops at the first missing piece."""
+    by_offset = {}
+    for piece in pieces:
+        by_offset.setdefault(piece['offset'], piece)
+
+    compressed = b''
+    complete = False
+    for offset in sorted(by_offset):
+        piece = by_offset[offset]
+        if offset != len(compressed):
+            print(f"Warning: Stream piece missing before piece {piece['seq']} (offset {len(compressed)})")
+            break
+        compressed += piece['data']
+        if piece['flags'] & FRAME_STREAM_END:
+            complete = True
+            break
+
+    first = pieces[0]
+    print(f"Stream: {len(by_offset)} pieces, {len(compressed)} compressed bytes, "
+          f"expected uncompressed size: {first['size']} bytes")
+    if not complete:
+        print("Warning: Last stream piece is missing")
+    data = zstd_decompress(compressed, first['dict_id'], partial=not complete)
+    return data.decode('utf-8', errors='replace') if data is not None else None
+
+
+def decode_tiles(tiles, seq_state):
+    """Decode frames shown in tiled mode, which were scanned in any order,
+    by their number."""
+    output = []
+    expected = 0
+    for seq in sorted(tiles):
+        if seq != expected:
+            print(f"Warning: missing tiled frames {expected}-{seq - 1}")
+        expected = seq + 1
+        text = decompress_frame(tiles[seq], seq_state)
+        if text:
+            output.append(text)
+    return ''.join(output)
+
+
+def decode_frames(payloads):
+    """Decode a list of payloads in scan order. Independent frames are decoded
+    on their own, stream pieces are grouped per stream and decoded together,
+    and tiled frames are put back in order."""
+    output = []
+    streams = {}
+    tiles = {}
+    seq_state = {}
+    for data in (part for payload in payloads for part in split_payload(payload)):
+        frame = parse_frame(data)
+        if not frame:
+            continue
+        if frame['flags'] & FRAME_STREAM:
+            key = frame['stream_id']
+            if key not in streams:
+                streams[key] = []
+                output.append(streams[key])
+            streams[key].append(frame)
+            continue
+        if frame['flags'] & FRAME_TILE:
+            if not tiles:
+                output.append(tiles)
+            tiles.setdefault(frame['seq'], frame)
+            continue
+        print(f"Compressed data size: {len(frame['data'])} bytes")
+        print(f"Expected uncompressed size: {frame['size']} bytes")
+        text = decompress_frame(frame, seq_state)
+        if text:
+            output.append(text)
+
+    return ''.join(item if isinstance(item, str) else
+                   decode_tiles(item, seq_state) if isinstance(item, dict) else
+                   (decode_stream(item) or '') for item in output)
+
+
 def parse_qrcode_json(json_data):
     """Parse JSON data containing QR code entries and decode their content."""
     try:
@@ -85,16 +575,14 @@ def parse_qrcode_json(json_data):
         # Sort entries by _datetime field in ascending order
         qr_entries = sorted(qr_entries, key=lambda entry: entry.get('_datetime', '') if isinstance(entry, dict) else '')
 
-        combined_output = ""
+        payloads = []
         for i, entry in enumerate(qr_entries):
             if not isinstance(entry, dict) or 'content' not in entry:
                 print(f"Warning: Entry {i} is missing 'content' field, skipping")
                 continue
             print(f"\nProcessing QR code {i+1}/{len(qr_entries)} (datetime: {entry.get('_datetime', 'unknown')})")
-            result = decode_qrcon_data(entry['content'])
-            if result:
-                combined_output += result
-        return combined_output
+            payloads.append(entry['content'])
+        return decode_frames(payloads)
     except json.JSONDecodeError as e:
         print(f"Error parsing JSON: {e}")
         return None
@@ -166,6 +654,7 @@ def monitor_database():
         sys.exit(1)
 
     raw_decoded_buffer = []
+    stream_buffer = []  # Stream pieces and tiled frames can only be decoded once the panic output is over
     last_activity_time = time.time()
 
     while True:
@@ -183,12 +672,22 @@ def monitor_database():
                     print(f"Processing entry ID: {row_id}, Datetime: {dt}")
                     last_processed_id = row_id
                     if raw_data:
-                        decoded_data = decode_qrcon_data(raw_data)
-                        if decoded_data:
-                            raw_decoded_buffer.append(decoded_data)
+                        for part in split_payload(raw_data):
+                            frame = parse_frame(part)
+                            if frame and frame['flags'] & (FRAME_STREAM | FRAME_TILE):
+                                kind = "stream piece" if frame['flags'] & FRAME_STREAM else "tiled frame"
+                                print(f"Buffered {kind} {frame['seq']}")
+                                stream_buffer.append(part)
+                                continue
+                            decoded_data = decode_qrcon_data(part)
+                            if decoded_data:
+                                raw_decoded_buffer.append(decoded_data)
                     else:
                         print(f"Skipping entry ID {row_id}: 'raw' column is NULL or empty.")
-            elif raw_decoded_buffer and (time.time() - last_activity_time >= INACTIVITY_THRESHOLD):
+            elif (raw_decoded_buffer or stream_buffer) and (time.time() - last_activity_time >= INACTIVITY_THRESHOLD):
+                if stream_buffer:
+                    raw_decoded_buffer.append(decode_frames(stream_buffer))
+                    stream_buffer = []
                 filename = get_next_log_filename()
                 with open(filename, 'w') as f:
                     f.write(colorize_output("".join(raw_decoded_buffer)))
@@ -199,6 +698,8 @@ def monitor_database():
             print("Database error during polling:", e)
             time.sleep(POLL_INTERVAL * 2)
         except KeyboardInterrupt:
+            if stream_buffer:
+                raw_decoded_buffer.append(decode_frames(stream_buffer))
             if raw_decoded_buffer:
                 filename = get_next_log_filename()
                 with open(filename, 'w') as f:
@@ -244,9 +745,9 @@ def main():
                     result = parse_qrcode_json(data_text)
                 else:
                     hex_data = ''.join(data_text.replace('0x', '').split())
-                    result = decode_qrcon_data(hex_data)
+                    result = decode_frames([hex_data])
             except UnicodeDecodeError:
-                result = decode_qrcon_data(file_data)
+                result = decode_frames([file_data])
         except Exception as e:
             print(f"Error reading file: {e}")
             return
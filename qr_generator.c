@@ -2,9 +2,13 @@
 // TAKEN FROM DRM_PANIC_QR.RS
 /* QR Code Generator Library
  *
- * This is a simple QR encoder that doesn't allocate memory and does all the work
- * on the stack or on the provided buffers. For simplification, it only supports
- * low error correction, and applies the first mask (checkerboard).
+ * This is a simple QR encoder that doesn't allocate memory. Besides the stack
+ * and the provided buffers, it keeps about 90 KB of static tables: the function
+ * patterns and data placement of the last version, Reed-Solomon products and
+ * the images of the mask search. qr_generate() is therefore not reentrant,
+ * callers must serialize, and qr_generator_init() builds the tables of the
+ * version in use ahead of time. It supports the four error correction levels.
+ * The mask is either fixed or the one with the lowest ISO 18004 penalty.
  *
  * The binary data must be a valid url parameter, so the easiest way is
  * to use base64 encoding. But this waste 25% of data space, so the
@@ -18,19 +22,41 @@
  *
  */
 
+#include <linux/bitops.h>
+#include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/types.h>
+#include <asm/simd.h>
 #include "qr_generator.h"
 
+#ifdef CONFIG_X86
+#define QR_RS_SSSE3
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
 /* Maximum sizes for buffers */
 #define MAX_EC_SIZE 30
 #define MAX_BLK_SIZE 123
+#define MAX_IMAGE_SIZE 4071 /* V40: 177 rows of 23 bytes */
+#define MAX_STRIDE 23
+#define MAX_MSG_SIZE 3706 /* V40: data and EC codewords */
+#define MAX_BLOCKS 81 /* V40-H */
+
+/* Bytes per Reed-Solomon register, the largest EC size rounded up to whole vectors */
+#define QR_RS_REG_SIZE 32
+
+/* Reed-Solomon kernel, see qr_rs_blocks_scalar() */
+typedef void (*qr_rs_blocks_fn)(u8 (*regs)[QR_RS_REG_SIZE], const u8 (*mul)[QR_RS_REG_SIZE],
+				const u8 *data, size_t blocks, size_t stride, size_t len,
+				size_t ec_size);
 
 /* Segment mode bits */
 #define MODE_STOP 0
 #define MODE_NUMERIC 1
+#define MODE_STRUCTURED_APPEND 3
 #define MODE_BINARY 4
 
 /* Padding bytes */
@@ -39,19 +65,25 @@ static const u8 PADDING[2] = {236, 17};
 /**
  * struct qr_version - QR code version information
  * @version: Version number (1-40)
+ * @ec_level: Error correction level, QR_ECC_*
  */
 struct qr_version {
 	u8 version;
+	u8 ec_level;
 };
 
 /**
  * enum segment_type - Type of QR code segment
  * @SEGMENT_BINARY: Binary segment (8-bit bytes)
  * @SEGMENT_NUMERIC: Numeric segment (decimal digits)
+ * @SEGMENT_STRUCTURED_APPEND: Structured Append header, 2 bytes of data
+ *                             (index and total - 1, then parity) and no
+ *                             length field
  */
 enum segment_type {
 	SEGMENT_BINARY,
-	SEGMENT_NUMERIC
+	SEGMENT_NUMERIC,
+	SEGMENT_STRUCTURED_APPEND
 };
 
 /**
@@ -94,20 +126,97 @@ struct encoded_msg {
  * @width: Width of QR code in modules
  * @stride: Bytes per row in the buffer
  * @version: QR code version
+ * @reserved: Reserved module bitmap of the version, see struct qr_template
  */
 struct qr_image {
 	u8 *data;
 	u8 width;
 	u8 stride;
 	struct qr_version version;
+	const u8 *reserved;
+};
+
+/**
+ * struct qr_template - Function patterns of a QR version
+ * @version: Version the template was built for, 0 if none yet
+ * @ec_level: Error correction level the placement was built for
+ * @image: Finder, alignment, timing and version info patterns, which every
+ *         code of this version starts with, and the masked remainder bits
+ * @reserved: Same layout as the image, with a bit set for every module that
+ *            does not carry data, including the format info and the padding
+ *            bits at the end of each row
+ * @placement: Image position of every bit of the encoded message, in the
+ *             order of encoded_msg.data (blocks, then their EC codewords),
+ *             see QR_PLACE_*. Depends on the block layout, so on the level.
+ *
+ * Built once when the version or level changes, instead of testing every module
+ * against every pattern and de-interleaving the blocks while placing data.
+ */
+struct qr_template {
+	u8 version;
+	u8 ec_level;
+	u8 image[MAX_IMAGE_SIZE];
+	u8 reserved[MAX_IMAGE_SIZE];
+	u16 placement[MAX_MSG_SIZE * 8];
+};
+
+/*
+ * A placement entry is the bit offset of the module in the image, with the
+ * top bit set when the mask leaves it as is, so that the module is light
+ * when the data bit is 0. Masked modules are light when the data bit is 1.
+ */
+#define QR_PLACE_POS_MASK 0x7FFF
+#define QR_PLACE_UNMASKED 0x8000
+
+static struct qr_template qr_template;
+
+/**
+ * struct qr_rs_table - Products with a generator polynomial
+ * @poly: Generator polynomial the table was built for, NULL if none yet
+ * @mul: mul[c][j] is c times coefficient j of @poly in GF(256), 0 past the
+ *       EC size of the polynomial
+ *
+ * Lets the error correction step a block through the polynomial division
+ * with one lookup per EC byte, instead of a log, an exp and a modulo.
+ */
+struct qr_rs_table {
+	const u8 *poly;
+	u8 mul[256][QR_RS_REG_SIZE] __aligned(16);
 };
 
-/* Generator polynomials for ECC, only those needed for low quality */
+static struct qr_rs_table qr_rs_table;
+
+/* EC registers of the blocks being encoded, 0 past the EC size */
+static u8 qr_rs_regs[MAX_BLOCKS][QR_RS_REG_SIZE] __aligned(16);
+
+/**
+ * struct qr_rs_impl - Reed-Solomon kernel using vector registers
+ * @name: Name for the log
+ * @usable: Whether the CPU supports it
+ * @blocks: Kernel, see qr_rs_blocks_scalar()
+ */
+struct qr_rs_impl {
+	const char *name;
+	bool (*usable)(void);
+	qr_rs_blocks_fn blocks;
+};
+
+/* Vector kernel in use, NULL until qr_generator_init() tested one */
+static const struct qr_rs_impl *qr_rs_simd;
+
+/* Generator polynomials for ECC, one per EC block size */
 static const u8 P7[7] = {87, 229, 146, 149, 238, 102, 21};
 static const u8 P10[10] = {251, 67, 46, 61, 118, 70, 64, 94, 32, 45};
+static const u8 P13[13] = {74, 152, 176, 100, 86, 100, 106, 104, 130, 218, 206, 140, 78};
 static const u8 P15[15] = {
 	8, 183, 61, 91, 202, 37, 51, 58, 58, 237, 140, 124, 5, 99, 105,
 };
+static const u8 P16[16] = {
+	120, 104, 107, 109, 102, 161, 76, 3, 91, 191, 147, 169, 182, 194, 225, 120,
+};
+static const u8 P17[17] = {
+	43, 139, 206, 78, 43, 239, 123, 206, 214, 147, 24, 99, 150, 39, 243, 163, 136,
+};
 static const u8 P18[18] = {
 	215, 234, 158, 94, 184, 97, 118, 170, 79, 187, 152, 148, 252, 179, 5, 98, 96, 153,
 };
@@ -136,7 +245,7 @@ static const u8 P30[30] = {
 };
 
 /**
- * struct qr_version_param - QR code parameters for Low quality ECC
+ * struct qr_version_param - QR code parameters of a version at one ECC level
  * @poly: Error correction polynomial
  * @g1_blocks: Number of blocks in group 1
  * @g2_blocks: Number of blocks in group 2
@@ -149,48 +258,176 @@ struct qr_version_param {
 	u8 g1_blk_size;
 };
 
-/* QR version parameters for Low quality ECC */
-static const struct qr_version_param VPARAM[40] = {
-	{P7, 1, 0, 19},     /* V1 */
-	{P10, 1, 0, 34},    /* V2 */
-	{P15, 1, 0, 55},    /* V3 */
-	{P20, 1, 0, 80},    /* V4 */
-	{P26, 1, 0, 108},   /* V5 */
-	{P18, 2, 0, 68},    /* V6 */
-	{P20, 2, 0, 78},    /* V7 */
-	{P24, 2, 0, 97},    /* V8 */
-	{P30, 2, 0, 116},   /* V9 */
-	{P18, 2, 2, 68},    /* V10 */
-	{P20, 4, 0, 81},    /* V11 */
-	{P24, 2, 2, 92},    /* V12 */
-	{P26, 4, 0, 107},   /* V13 */
-	{P30, 3, 1, 115},   /* V14 */
-	{P22, 5, 1, 87},    /* V15 */
-	{P24, 5, 1, 98},    /* V16 */
-	{P28, 1, 5, 107},   /* V17 */
-	{P30, 5, 1, 120},   /* V18 */
-	{P28, 3, 4, 113},   /* V19 */
-	{P28, 3, 5, 107},   /* V20 */
-	{P28, 4, 4, 116},   /* V21 */
-	{P28, 2, 7, 111},   /* V22 */
-	{P30, 4, 5, 121},   /* V23 */
-	{P30, 6, 4, 117},   /* V24 */
-	{P26, 8, 4, 106},   /* V25 */
-	{P28, 10, 2, 114},  /* V26 */
-	{P30, 8, 4, 122},   /* V27 */
-	{P30, 3, 10, 117},  /* V28 */
-	{P30, 7, 7, 116},   /* V29 */
-	{P30, 5, 10, 115},  /* V30 */
-	{P30, 13, 3, 115},  /* V31 */
-	{P30, 17, 0, 115},  /* V32 */
-	{P30, 17, 1, 115},  /* V33 */
-	{P30, 13, 6, 115},  /* V34 */
-	{P30, 12, 7, 121},  /* V35 */
-	{P30, 6, 14, 121},  /* V36 */
-	{P30, 17, 4, 122},  /* V37 */
-	{P30, 4, 18, 122},  /* V38 */
-	{P30, 20, 4, 117},  /* V39 */
-	{P30, 19, 6, 118},  /* V40 */
+/* QR version parameters, indexed by QR_ECC_* level then version */
+static const struct qr_version_param VPARAM[4][40] = {
+	[QR_ECC_L] = { /* Low quality, ~7% recovery */
+		{P7, 1, 0, 19},     /* V1 */
+		{P10, 1, 0, 34},    /* V2 */
+		{P15, 1, 0, 55},    /* V3 */
+		{P20, 1, 0, 80},    /* V4 */
+		{P26, 1, 0, 108},   /* V5 */
+		{P18, 2, 0, 68},    /* V6 */
+		{P20, 2, 0, 78},    /* V7 */
+		{P24, 2, 0, 97},    /* V8 */
+		{P30, 2, 0, 116},   /* V9 */
+		{P18, 2, 2, 68},    /* V10 */
+		{P20, 4, 0, 81},    /* V11 */
+		{P24, 2, 2, 92},    /* V12 */
+		{P26, 4, 0, 107},   /* V13 */
+		{P30, 3, 1, 115},   /* V14 */
+		{P22, 5, 1, 87},    /* V15 */
+		{P24, 5, 1, 98},    /* V16 */
+		{P28, 1, 5, 107},   /* V17 */
+		{P30, 5, 1, 120},   /* V18 */
+		{P28, 3, 4, 113},   /* V19 */
+		{P28, 3, 5, 107},   /* V20 */
+		{P28, 4, 4, 116},   /* V21 */
+		{P28, 2, 7, 111},   /* V22 */
+		{P30, 4, 5, 121},   /* V23 */
+		{P30, 6, 4, 117},   /* V24 */
+		{P26, 8, 4, 106},   /* V25 */
+		{P28, 10, 2, 114},  /* V26 */
+		{P30, 8, 4, 122},   /* V27 */
+		{P30, 3, 10, 117},  /* V28 */
+		{P30, 7, 7, 116},   /* V29 */
+		{P30, 5, 10, 115},  /* V30 */
+		{P30, 13, 3, 115},  /* V31 */
+		{P30, 17, 0, 115},  /* V32 */
+		{P30, 17, 1, 115},  /* V33 */
+		{P30, 13, 6, 115},  /* V34 */
+		{P30, 12, 7, 121},  /* V35 */
+		{P30, 6, 14, 121},  /* V36 */
+		{P30, 17, 4, 122},  /* V37 */
+		{P30, 4, 18, 122},  /* V38 */
+		{P30, 20, 4, 117},  /* V39 */
+		{P30, 19, 6, 118},  /* V40 */
+	},
+	[QR_ECC_M] = { /* Medium quality, ~15% recovery */
+		{P10, 1, 0, 16},    /* V1 */
+		{P16, 1, 0, 28},    /* V2 */
+		{P26, 1, 0, 44},    /* V3 */
+		{P18, 2, 0, 32},    /* V4 */
+		{P24, 2, 0, 43},    /* V5 */
+		{P16, 4, 0, 27},    /* V6 */
+		{P18, 4, 0, 31},    /* V7 */
+		{P22, 2, 2, 38},    /* V8 */
+		{P22, 3, 2, 36},    /* V9 */
+		{P26, 4, 1, 43},    /* V10 */
+		{P30, 1, 4, 50},    /* V11 */
+		{P22, 6, 2, 36},    /* V12 */
+		{P22, 8, 1, 37},    /* V13 */
+		{P24, 4, 5, 40},    /* V14 */
+		{P24, 5, 5, 41},    /* V15 */
+		{P28, 7, 3, 45},    /* V16 */
+		{P28, 10, 1, 46},   /* V17 */
+		{P26, 9, 4, 43},    /* V18 */
+		{P26, 3, 11, 44},   /* V19 */
+		{P26, 3, 13, 41},   /* V20 */
+		{P26, 17, 0, 42},   /* V21 */
+		{P28, 17, 0, 46},   /* V22 */
+		{P28, 4, 14, 47},   /* V23 */
+		{P28, 6, 14, 45},   /* V24 */
+		{P28, 8, 13, 47},   /* V25 */
+		{P28, 19, 4, 46},   /* V26 */
+		{P28, 22, 3, 45},   /* V27 */
+		{P28, 3, 23, 45},   /* V28 */
+		{P28, 21, 7, 45},   /* V29 */
+		{P28, 19, 10, 47},  /* V30 */
+		{P28, 2, 29, 46},   /* V31 */
+		{P28, 10, 23, 46},  /* V32 */
+		{P28, 14, 21, 46},  /* V33 */
+		{P28, 14, 23, 46},  /* V34 */
+		{P28, 12, 26, 47},  /* V35 */
+		{P28, 6, 34, 47},   /* V36 */
+		{P28, 29, 14, 46},  /* V37 */
+		{P28, 13, 32, 46},  /* V38 */
+		{P28, 40, 7, 47},   /* V39 */
+		{P28, 18, 31, 47},  /* V40 */
+	},
+	[QR_ECC_Q] = { /* Quartile quality, ~25% recovery */
+		{P13, 1, 0, 13},    /* V1 */
+		{P22, 1, 0, 22},    /* V2 */
+		{P18, 2, 0, 17},    /* V3 */
+		{P26, 2, 0, 24},    /* V4 */
+		{P18, 2, 2, 15},    /* V5 */
+		{P24, 4, 0, 19},    /* V6 */
+		{P18, 2, 4, 14},    /* V7 */
+		{P22, 4, 2, 18},    /* V8 */
+		{P20, 4, 4, 16},    /* V9 */
+		{P24, 6, 2, 19},    /* V10 */
+		{P28, 4, 4, 22},    /* V11 */
+		{P26, 4, 6, 20},    /* V12 */
+		{P24, 8, 4, 20},    /* V13 */
+		{P20, 11, 5, 16},   /* V14 */
+		{P30, 5, 7, 24},    /* V15 */
+		{P24, 15, 2, 19},   /* V16 */
+		{P28, 1, 15, 22},   /* V17 */
+		{P28, 17, 1, 22},   /* V18 */
+		{P26, 17, 4, 21},   /* V19 */
+		{P30, 15, 5, 24},   /* V20 */
+		{P28, 17, 6, 22},   /* V21 */
+		{P30, 7, 16, 24},   /* V22 */
+		{P30, 11, 14, 24},  /* V23 */
+		{P30, 11, 16, 24},  /* V24 */
+		{P30, 7, 22, 24},   /* V25 */
+		{P28, 28, 6, 22},   /* V26 */
+		{P30, 8, 26, 23},   /* V27 */
+		{P30, 4, 31, 24},   /* V28 */
+		{P30, 1, 37, 23},   /* V29 */
+		{P30, 15, 25, 24},  /* V30 */
+		{P30, 42, 1, 24},   /* V31 */
+		{P30, 10, 35, 24},  /* V32 */
+		{P30, 29, 19, 24},  /* V33 */
+		{P30, 44, 7, 24},   /* V34 */
+		{P30, 39, 14, 24},  /* V35 */
+		{P30, 46, 10, 24},  /* V36 */
+		{P30, 49, 10, 24},  /* V37 */
+		{P30, 48, 14, 24},  /* V38 */
+		{P30, 43, 22, 24},  /* V39 */
+		{P30, 34, 34, 24},  /* V40 */
+	},
+	[QR_ECC_H] = { /* High quality, ~30% recovery */
+		{P17, 1, 0, 9},     /* V1 */
+		{P28, 1, 0, 16},    /* V2 */
+		{P22, 2, 0, 13},    /* V3 */
+		{P16, 4, 0, 9},     /* V4 */
+		{P22, 2, 2, 11},    /* V5 */
+		{P28, 4, 0, 15},    /* V6 */
+		{P26, 4, 1, 13},    /* V7 */
+		{P26, 4, 2, 14},    /* V8 */
+		{P24, 4, 4, 12},    /* V9 */
+		{P28, 6, 2, 15},    /* V10 */
+		{P24, 3, 8, 12},    /* V11 */
+		{P28, 7, 4, 14},    /* V12 */
+		{P22, 12, 4, 11},   /* V13 */
+		{P24, 11, 5, 12},   /* V14 */
+		{P24, 11, 7, 12},   /* V15 */
+		{P30, 3, 13, 15},   /* V16 */
+		{P28, 2, 17, 14},   /* V17 */
+		{P28, 2, 19, 14},   /* V18 */
+		{P26, 9, 16, 13},   /* V19 */
+		{P28, 15, 10, 15},  /* V20 */
+		{P30, 19, 6, 16},   /* V21 */
+		{P24, 34, 0, 13},   /* V22 */
+		{P30, 16, 14, 15},  /* V23 */
+		{P30, 30, 2, 16},   /* V24 */
+		{P30, 22, 13, 15},  /* V25 */
+		{P30, 33, 4, 16},   /* V26 */
+		{P30, 12, 28, 15},  /* V27 */
+		{P30, 11, 31, 15},  /* V28 */
+		{P30, 19, 26, 15},  /* V29 */
+		{P30, 23, 25, 15},  /* V30 */
+		{P30, 23, 28, 15},  /* V31 */
+		{P30, 19, 35, 15},  /* V32 */
+		{P30, 11, 46, 15},  /* V33 */
+		{P30, 59, 1, 16},   /* V34 */
+		{P30, 22, 41, 15},  /* V35 */
+		{P30, 2, 64, 15},   /* V36 */
+		{P30, 24, 46, 15},  /* V37 */
+		{P30, 42, 32, 15},  /* V38 */
+		{P30, 10, 67, 15},  /* V39 */
+		{P30, 20, 61, 15},  /* V40 */
+	},
 };
 
 /* Position of the alignment pattern grid - using a 2D array for cleaner code
@@ -277,9 +514,12 @@ static const u32 VERSION_INFORMATION[34] = {
 	0x28C69,  /* 0b10_1000_1100_0110_1001 */
 };
 
-/* Format info for low quality ECC */
-static const u16 FORMAT_INFOS_QR_L[8] = {
-	0x77c4, 0x72f3, 0x7daa, 0x789d, 0x662f, 0x6318, 0x6c41, 0x6976,
+/* Format info, indexed by QR_ECC_* level then mask */
+static const u16 FORMAT_INFOS[4][8] = {
+	[QR_ECC_L] = {0x77c4, 0x72f3, 0x7daa, 0x789d, 0x662f, 0x6318, 0x6c41, 0x6976},
+	[QR_ECC_M] = {0x5412, 0x5125, 0x5e7c, 0x5b4b, 0x45f9, 0x40ce, 0x4f97, 0x4aa0},
+	[QR_ECC_Q] = {0x355f, 0x3068, 0x3f31, 0x3a06, 0x24b4, 0x2183, 0x2eda, 0x2bed},
+	[QR_ECC_H] = {0x1689, 0x13be, 0x1ce7, 0x19d0, 0x0762, 0x0255, 0x0d0c, 0x083b},
 };
 
 /* Exponential table for Galois Field GF(256) */
@@ -334,18 +574,9 @@ struct segment_iterator {
 	size_t carry_len;
 };
 
-/**
- * struct encoded_msg_iterator - Iterator for encoded message
- * @em: Pointer to encoded message
- * @offset: Current offset in the interleaved data
- */
-struct encoded_msg_iterator {
-	const struct encoded_msg *em;
-	size_t offset;
-};
-
 /* Function prototypes */
-static struct qr_version qr_version_from_segments(const struct qr_segment *segments[], size_t count);
+static struct qr_version qr_version_from_segments(const struct qr_segment *segments[], size_t count,
+						  u8 ec_level);
 static size_t qr_segment_total_size_bits(const struct qr_segment *segment, struct qr_version version);
 static u8 qr_version_width(struct qr_version version);
 static size_t qr_version_max_data(struct qr_version version);
@@ -368,6 +599,21 @@ static u8 qr_version_width(struct qr_version version)
 	return (version.version * 4) + 17;
 }
 
+/**
+ * qr_version_param() - Get the parameters of a QR version at its ECC level
+ * @version: The QR code version
+ *
+ * Return: Parameters, NULL if the version or level is invalid
+ */
+static const struct qr_version_param *qr_version_param(struct qr_version version)
+{
+	size_t v = version.version - 1;
+	if (v >= 40 || version.ec_level > QR_ECC_H)
+		return NULL;
+	
+	return &VPARAM[version.ec_level][v];
+}
+
 /**
  * qr_version_max_data() - Get maximum data capacity for a QR version
  * @version: The QR code version
@@ -376,12 +622,12 @@ static u8 qr_version_width(struct qr_version version)
  */
 static size_t qr_version_max_data(struct qr_version version)
 {
-	size_t v = version.version - 1;
-	if (v >= 40)
+	const struct qr_version_param *param = qr_version_param(version);
+	if (!param)
 		return 0;
 	
-	return VPARAM[v].g1_blk_size * VPARAM[v].g1_blocks +
-	       (VPARAM[v].g1_blk_size + 1) * VPARAM[v].g2_blocks;
+	return param->g1_blk_size * param->g1_blocks +
+	       (param->g1_blk_size + 1) * param->g2_blocks;
 }
 
 /**
@@ -392,22 +638,24 @@ static size_t qr_version_max_data(struct qr_version version)
  */
 static size_t qr_version_ec_size(struct qr_version version)
 {
-	size_t v = version.version - 1;
-	if (v >= 40)
+	const struct qr_version_param *param = qr_version_param(version);
+	if (!param)
 		return 0;
 	
 	/* Length of the polynomial */
-	return VPARAM[v].poly == NULL ? 0 : 
-	       (VPARAM[v].poly == P7 ? 7 :
-	        VPARAM[v].poly == P10 ? 10 :
-	        VPARAM[v].poly == P15 ? 15 :
-	        VPARAM[v].poly == P18 ? 18 :
-	        VPARAM[v].poly == P20 ? 20 :
-	        VPARAM[v].poly == P22 ? 22 :
-	        VPARAM[v].poly == P24 ? 24 :
-	        VPARAM[v].poly == P26 ? 26 :
-	        VPARAM[v].poly == P28 ? 28 :
-	        VPARAM[v].poly == P30 ? 30 : 0);
+	return param->poly == P7 ? 7 :
+	       param->poly == P10 ? 10 :
+	       param->poly == P13 ? 13 :
+	       param->poly == P15 ? 15 :
+	       param->poly == P16 ? 16 :
+	       param->poly == P17 ? 17 :
+	       param->poly == P18 ? 18 :
+	       param->poly == P20 ? 20 :
+	       param->poly == P22 ? 22 :
+	       param->poly == P24 ? 24 :
+	       param->poly == P26 ? 26 :
+	       param->poly == P28 ? 28 :
+	       param->poly == P30 ? 30 : 0;
 }
 
 /**
@@ -418,11 +666,11 @@ static size_t qr_version_ec_size(struct qr_version version)
  */
 static size_t qr_version_g1_blocks(struct qr_version version)
 {
-	size_t v = version.version - 1;
-	if (v >= 40)
+	const struct qr_version_param *param = qr_version_param(version);
+	if (!param)
 		return 0;
 	
-	return VPARAM[v].g1_blocks;
+	return param->g1_blocks;
 }
 
 /**
@@ -433,11 +681,11 @@ static size_t qr_version_g1_blocks(struct qr_version version)
  */
 static size_t qr_version_g2_blocks(struct qr_version version)
 {
-	size_t v = version.version - 1;
-	if (v >= 40)
+	const struct qr_version_param *param = qr_version_param(version);
+	if (!param)
 		return 0;
 	
-	return VPARAM[v].g2_blocks;
+	return param->g2_blocks;
 }
 
 /**
@@ -448,11 +696,11 @@ static size_t qr_version_g2_blocks(struct qr_version version)
  */
 static size_t qr_version_g1_blk_size(struct qr_version version)
 {
-	size_t v = version.version - 1;
-	if (v >= 40)
+	const struct qr_version_param *param = qr_version_param(version);
+	if (!param)
 		return 0;
 	
-	return VPARAM[v].g1_blk_size;
+	return param->g1_blk_size;
 }
 
 /**
@@ -478,11 +726,11 @@ static const u8 *qr_version_alignment_pattern(struct qr_version version)
  */
 static const u8 *qr_version_poly(struct qr_version version)
 {
-	size_t v = version.version - 1;
-	if (v >= 40)
+	const struct qr_version_param *param = qr_version_param(version);
+	if (!param)
 		return NULL;
 	
-	return VPARAM[v].poly;
+	return param->poly;
 }
 
 /**
@@ -568,6 +816,9 @@ static size_t qr_segment_total_size_bits(const struct qr_segment *segment,
 		digits = qr_segment_character_count(segment);
 		data_size = 10 * (digits / 3) + NUM_CHARS_BITS[digits % 3];
 		break;
+	case SEGMENT_STRUCTURED_APPEND:
+		data_size = 16;
+		break;
 	default:
 		return 0;
 	}
@@ -644,15 +895,19 @@ static u16 get_next_13b(const u8 *data, size_t data_len, size_t offset, size_t *
  * qr_version_from_segments() - Find the smallest QR version that can hold these segments
  * @segments: Array of segment pointers
  * @count: Number of segments
+ * @ec_level: Error correction level, QR_ECC_*
  *
  * Return: The appropriate QR version, version.version = 0 if no suitable version found
  */
-static struct qr_version __maybe_unused qr_version_from_segments(const struct qr_segment *segments[], size_t count)
+static struct qr_version __maybe_unused qr_version_from_segments(const struct qr_segment *segments[], size_t count,
+								  u8 ec_level)
 {
 	size_t v;
 	struct qr_version version;
 	size_t total_bits;
 	
+	version.ec_level = ec_level;
+	
 	/* Try versions from 1 to 40 */
 	for (v = 1; v <= 40; v++) {
 		version.version = v;
@@ -691,6 +946,8 @@ static u16 qr_segment_get_header(const struct qr_segment *segment, size_t *size)
 		return MODE_BINARY;
 	case SEGMENT_NUMERIC:
 		return MODE_NUMERIC;
+	case SEGMENT_STRUCTURED_APPEND:
+		return MODE_STRUCTURED_APPEND;
 	default:
 		return 0;
 	}
@@ -754,6 +1011,7 @@ static bool qr_segment_iterator_next(struct segment_iterator *iter, u16 *bits, s
 	
 	switch (iter->segment->type) {
 	case SEGMENT_BINARY:
+	case SEGMENT_STRUCTURED_APPEND:
 		/* For binary segments, simply return the next byte */
 		if (iter->offset < iter->segment->length) {
 			*bits = iter->segment->data[iter->offset++];
@@ -829,6 +1087,7 @@ static bool encoded_msg_init(struct encoded_msg *em,
                            const struct qr_segment *segments[],
                            size_t count,
                            u8 qr_version, /* The QR version to use */
+                           u8 ec_level, /* QR_ECC_* */
                            u8 *data,
                            size_t data_size)
 {
@@ -850,7 +1109,12 @@ static bool encoded_msg_init(struct encoded_msg *em,
 		pr_err("qr_generator: Invalid QR version specified (%u)\\n", qr_version);
 		return false;
 	}
+	if (ec_level > QR_ECC_H) {
+		pr_err("qr_generator: Invalid error correction level specified (%u)\n", ec_level);
+		return false;
+	}
 	version.version = qr_version;
+	version.ec_level = ec_level;
 	
 	/* Calculate total bits required for segments + terminator */
 	for (i = 0; i < count; i++) {
@@ -953,9 +1217,10 @@ static void encoded_msg_add_segments(struct encoded_msg *em,
 		bits = qr_segment_get_header(segments[i], &size);
 		encoded_msg_push(em, &offset, bits, size);
 		
-		/* Add segment length */
+		/* Add segment length, if the mode has one */
 		bits = qr_segment_get_length_field(segments[i], em->version, &size);
-		encoded_msg_push(em, &offset, bits, size);
+		if (size)
+			encoded_msg_push(em, &offset, bits, size);
 		
 		/* Add segment data */
 		qr_segment_iterator_init(&iter, segments[i]);
@@ -980,65 +1245,160 @@ static void encoded_msg_add_segments(struct encoded_msg *em,
 }
 
 /**
- * encoded_msg_error_code_for_block() - Compute error correction for a block
- * @em: Encoded message
- * @offset: Offset of block in data
- * @size: Size of block
- * @ec_offset: Offset where to store error correction
- */
-static void encoded_msg_error_code_for_block(struct encoded_msg *em,
-                                          size_t offset,
-                                          size_t size,
-                                          size_t ec_offset)
-{
-	u8 tmp[MAX_BLK_SIZE + MAX_EC_SIZE] = {0};
-	size_t lead_coeff;
-	size_t log_lead_coeff;
-	size_t i, j;
+ * encoded_msg_build_rs_table() - Fill qr_rs_table for a generator polynomial
+ * @em: Encoded message with the polynomial
+ */
+static void encoded_msg_build_rs_table(const struct encoded_msg *em)
+{
+	size_t c, j;
 	
-	/* Copy block data to temporary buffer */
-	memcpy(tmp, em->data + offset, size);
+	memset(qr_rs_table.mul, 0, sizeof(qr_rs_table.mul));
+	for (c = 1; c < 256; c++) {
+		for (j = 0; j < em->ec_size; j++)
+			qr_rs_table.mul[c][j] = EXP_TABLE[(em->poly[j] + LOG_TABLE[c]) % 255];
+	}
+	qr_rs_table.poly = em->poly;
+}
+
+/**
+ * qr_rs_blocks_scalar() - Feed data bytes to the EC registers of blocks
+ * @regs: Register of each block, the remainder of the block so far
+ * @mul: Product table of the generator polynomial
+ * @data: First data byte of the first block
+ * @blocks: Number of blocks
+ * @stride: Distance between the data of two blocks
+ * @len: Number of data bytes to feed to each block
+ * @ec_size: Number of EC bytes
+ *
+ * Each data byte shifts the register of its block by one byte, adding the
+ * generator polynomial times the byte shifted out. Once all data bytes are
+ * in, the register holds the error correction codewords. The registers of
+ * all blocks are stepped side by side, one data byte of each block at a
+ * time, so the CPU can overlap the independent blocks.
+ *
+ * This is the reference for the vector kernels, which step whole registers
+ * and rely on the bytes past @ec_size staying 0.
+ */
+static void qr_rs_blocks_scalar(u8 (*regs)[QR_RS_REG_SIZE], const u8 (*mul)[QR_RS_REG_SIZE],
+				const u8 *data, size_t blocks, size_t stride, size_t len,
+				size_t ec_size)
+{
+	const u8 *row;
+	size_t i, blk, j;
+	u8 *reg;
 	
-	/* Reed-Solomon algorithm for generating error correction codewords */
-	for (i = 0; i < size; i++) {
-		lead_coeff = tmp[i];
-		if (lead_coeff == 0)
-			continue;
-		
-		log_lead_coeff = LOG_TABLE[lead_coeff];
-		
-		for (j = 0; j < em->ec_size; j++) {
-			tmp[i + j + 1] ^= EXP_TABLE[(em->poly[j] + log_lead_coeff) % 255];
+	for (i = 0; i < len; i++) {
+		for (blk = 0; blk < blocks; blk++) {
+			reg = regs[blk];
+			row = mul[data[blk * stride + i] ^ reg[0]];
+			for (j = 0; j < ec_size - 1; j++)
+				reg[j] = reg[j + 1] ^ row[j];
+			reg[ec_size - 1] = row[ec_size - 1];
 		}
 	}
+}
+
+#ifdef QR_RS_SSSE3
+static bool qr_rs_ssse3_usable(void)
+{
+	return boot_cpu_has(X86_FEATURE_SSSE3);
+}
+
+/*
+ * qr_rs_blocks_scalar() with a register in two SSE registers, shifted with PALIGNR.
+ * Like lib/raid6, the XMM registers are not listed as clobbers: the kernel is
+ * built with -mno-sse, which rejects them, and only runs between
+ * kernel_fpu_begin() and kernel_fpu_end(), where the compiler uses none.
+ */
+static void qr_rs_blocks_ssse3(u8 (*regs)[QR_RS_REG_SIZE], const u8 (*mul)[QR_RS_REG_SIZE],
+			       const u8 *data, size_t blocks, size_t stride, size_t len,
+			       size_t ec_size)
+{
+	const u8 *row;
+	size_t i, blk;
+	u8 *reg;
 	
-	/* Copy error correction to output */
-	memcpy(em->data + ec_offset, tmp + size, em->ec_size);
+	for (i = 0; i < len; i++) {
+		for (blk = 0; blk < blocks; blk++) {
+			reg = regs[blk];
+			row = mul[data[blk * stride + i] ^ reg[0]];
+			asm volatile("movdqa %0, %%xmm0\n\t"
+				     "movdqa %1, %%xmm1\n\t"
+				     "movdqa %%xmm1, %%xmm2\n\t"
+				     "palignr $1, %%xmm0, %%xmm2\n\t"
+				     "psrldq $1, %%xmm1\n\t"
+				     "pxor %2, %%xmm2\n\t"
+				     "pxor %3, %%xmm1\n\t"
+				     "movdqa %%xmm2, %0\n\t"
+				     "movdqa %%xmm1, %1"
+				     : "+m" (*(u8 (*)[16])reg), "+m" (*(u8 (*)[16])(reg + 16))
+				     : "m" (*(const u8 (*)[16])row), "m" (*(const u8 (*)[16])(row + 16)));
+		}
+	}
+}
+#endif
+
+static const struct qr_rs_impl qr_rs_impls[] = {
+#ifdef QR_RS_SSSE3
+	{ "ssse3", qr_rs_ssse3_usable, qr_rs_blocks_ssse3 },
+#endif
+};
+
+static void qr_simd_begin(void)
+{
+#ifdef QR_RS_SSSE3
+	kernel_fpu_begin();
+#endif
+}
+
+static void qr_simd_end(void)
+{
+#ifdef QR_RS_SSSE3
+	kernel_fpu_end();
+#endif
+}
+
+/**
+ * encoded_msg_error_code_with() - Compute error correction with a given kernel
+ * @em: Encoded message
+ * @impl: Vector kernel, NULL for the scalar one
+ */
+static void encoded_msg_error_code_with(struct encoded_msg *em, const struct qr_rs_impl *impl)
+{
+	size_t g1_end = em->g1_blocks * em->g1_blk_size;
+	size_t ec_start = g1_end + em->g2_blocks * em->g2_blk_size;
+	size_t blocks = em->g1_blocks + em->g2_blocks;
+	qr_rs_blocks_fn fn = impl ? impl->blocks : qr_rs_blocks_scalar;
+	size_t blk;
+	
+	if (qr_rs_table.poly != em->poly)
+		encoded_msg_build_rs_table(em);
+	
+	memset(qr_rs_regs, 0, blocks * sizeof(qr_rs_regs[0]));
+	
+	if (impl)
+		qr_simd_begin();
+	fn(qr_rs_regs, qr_rs_table.mul, em->data, em->g1_blocks, em->g1_blk_size,
+	   em->g1_blk_size, em->ec_size);
+	fn(qr_rs_regs + em->g1_blocks, qr_rs_table.mul, em->data + g1_end, em->g2_blocks,
+	   em->g2_blk_size, em->g2_blk_size, em->ec_size);
+	if (impl)
+		qr_simd_end();
+	
+	for (blk = 0; blk < blocks; blk++)
+		memcpy(em->data + ec_start + blk * em->ec_size, qr_rs_regs[blk], em->ec_size);
 }
 
 /**
  * encoded_msg_compute_error_code() - Compute error correction for all blocks
  * @em: Encoded message
+ *
+ * Uses the vector kernel when there is one and the context allows it, e.g.
+ * not when panicking in an interrupt that came in while the FPU was in use.
  */
 static void encoded_msg_compute_error_code(struct encoded_msg *em)
 {
-	size_t offset = 0;
-	size_t ec_offset = em->g1_blocks * em->g1_blk_size + 
-	                 em->g2_blocks * em->g2_blk_size;
-	
-	/* Compute error correction for group 1 blocks */
-	for (size_t i = 0; i < em->g1_blocks; i++) {
-		encoded_msg_error_code_for_block(em, offset, em->g1_blk_size, ec_offset);
-		offset += em->g1_blk_size;
-		ec_offset += em->ec_size;
-	}
-	
-	/* Compute error correction for group 2 blocks */
-	for (size_t i = 0; i < em->g2_blocks; i++) {
-		encoded_msg_error_code_for_block(em, offset, em->g2_blk_size, ec_offset);
-		offset += em->g2_blk_size;
-		ec_offset += em->ec_size;
-	}
+	encoded_msg_error_code_with(em, (qr_rs_simd && may_use_simd()) ? qr_rs_simd : NULL);
 }
 
 /**
@@ -1056,61 +1416,53 @@ static void encoded_msg_encode(struct encoded_msg *em,
 }
 
 /**
- * encoded_msg_iterator_init() - Initialize encoded message iterator
- * @iter: Iterator to initialize
- * @em: Encoded message to iterate over
+ * encoded_msg_size() - Get the number of codewords of an encoded message
+ * @em: Encoded message
+ *
+ * Return: Number of data and EC codewords
  */
-static void encoded_msg_iterator_init(struct encoded_msg_iterator *iter,
-                                    const struct encoded_msg *em)
+static size_t encoded_msg_size(const struct encoded_msg *em)
 {
-	iter->em = em;
-	iter->offset = 0;
+	return em->g1_blocks * em->g1_blk_size + em->g2_blocks * em->g2_blk_size +
+	       (em->g1_blocks + em->g2_blocks) * em->ec_size;
 }
 
 /**
- * encoded_msg_iterator_next() - Get next byte from encoded message
- * @iter: The message iterator
- * @byte: Pointer to store the next byte
+ * encoded_msg_interleave() - Find the codeword sent at a given position
+ * @em: Encoded message
+ * @pos: Position in the interleaved output, less than encoded_msg_size()
+ *
+ * Codewords are sent one from each block in turn, first the data codewords,
+ * then the last data codeword of the longer group 2 blocks, then the EC
+ * codewords.
  *
- * Return: true if byte was retrieved, false if end of data
+ * Return: Offset of the codeword in em->data
  */
-static bool encoded_msg_iterator_next(struct encoded_msg_iterator *iter, u8 *byte)
+static size_t encoded_msg_interleave(const struct encoded_msg *em, size_t pos)
 {
-	const struct encoded_msg *em = iter->em;
 	size_t blocks = em->g1_blocks + em->g2_blocks;
 	size_t g1_end = em->g1_blocks * em->g1_blk_size;
 	size_t g2_end = g1_end + em->g2_blocks * em->g2_blk_size;
-	size_t ec_end = g2_end + em->ec_size * blocks;
-	size_t offset;
-	
-	if (!em || !iter || !byte || iter->offset >= ec_end)
-		return false;
 	
-	/* Interleaved output format */
-	if (iter->offset < em->g1_blk_size * blocks) {
+	if (pos < em->g1_blk_size * blocks) {
 		/* Interleave group 1 and group 2 blocks */
-		size_t blk = iter->offset % blocks;
-		size_t blk_off = iter->offset / blocks;
+		size_t blk = pos % blocks;
+		size_t blk_off = pos / blocks;
 		
 		if (blk < em->g1_blocks)
-			offset = blk * em->g1_blk_size + blk_off;
-		else
-			offset = g1_end + (blk - em->g1_blocks) * em->g2_blk_size + blk_off;
-	} else if (iter->offset < g2_end) {
+			return blk * em->g1_blk_size + blk_off;
+		return g1_end + (blk - em->g1_blocks) * em->g2_blk_size + blk_off;
+	} else if (pos < g2_end) {
 		/* Last byte of group 2 blocks */
-		size_t blk2 = iter->offset - blocks * em->g1_blk_size;
-		offset = g1_end + blk2 / em->g2_blk_size * em->g2_blk_size + em->g2_blk_size - 1;
+		size_t blk2 = pos - blocks * em->g1_blk_size;
+		return g1_end + blk2 * em->g2_blk_size + em->g2_blk_size - 1;
 	} else {
 		/* EC blocks */
-		size_t ec_offset = iter->offset - g2_end;
+		size_t ec_offset = pos - g2_end;
 		size_t blk = ec_offset % blocks;
 		size_t blk_off = ec_offset / blocks;
-		offset = g2_end + blk * em->ec_size + blk_off;
+		return g2_end + blk * em->ec_size + blk_off;
 	}
-	
-	*byte = em->data[offset];
-	iter->offset++;
-	return true;
 }
 
 /**
@@ -1161,21 +1513,6 @@ static void qr_image_set(struct qr_image *qr, u8 x, u8 y)
 		qr->data[offset] |= mask;
 }
 
-/**
- * qr_image_xor() - Invert a module (pixel)
- * @qr: QR image
- * @x: X coordinate
- * @y: Y coordinate
- */
-static void qr_image_xor(struct qr_image *qr, u8 x, u8 y)
-{
-	size_t offset = y * qr->stride + x / 8;
-	u8 mask = 0x80 >> (x % 8);
-	
-	if (x < qr->width && y < qr->width)
-		qr->data[offset] ^= mask;
-}
-
 /**
  * qr_image_draw_square() - Draw a square with top-left corner at (x,y)
  * @qr: QR image
@@ -1367,10 +1704,11 @@ static bool qr_image_is_maskinfo(const struct qr_image *qr, u8 x, u8 y)
 /**
  * qr_image_draw_maskinfo() - Draw format information
  * @qr: QR image
+ * @mask: Mask pattern (0-7)
  */
-static void qr_image_draw_maskinfo(struct qr_image *qr)
+static void qr_image_draw_maskinfo(struct qr_image *qr, u8 mask)
 {
-	u16 info = FORMAT_INFOS_QR_L[0];
+	u16 info = FORMAT_INFOS[qr->version.ec_level][mask];
 	u8 k, skip;
 	
 	/* Draw format info around the top left finder pattern */
@@ -1457,6 +1795,54 @@ static bool qr_image_is_reserved(const struct qr_image *qr, u8 x, u8 y)
 	       qr_image_is_version_info(qr, x, y);
 }
 
+/**
+ * qr_image_reserved() - Look up a module in the reserved bitmap
+ * @qr: QR image
+ * @x: X coordinate
+ * @y: Y coordinate
+ *
+ * Return: true if the module does not carry data
+ */
+static bool qr_image_reserved(const struct qr_image *qr, u8 x, u8 y)
+{
+	return qr->reserved[y * qr->stride + x / 8] & (0x80 >> (x % 8));
+}
+
+static void qr_template_place(struct qr_image *tmpl, const struct encoded_msg *em);
+
+/**
+ * qr_template_build() - Draw the function patterns of a version into qr_template
+ * @qr: QR image of that version
+ * @em: Encoded message of that version and level
+ */
+static void qr_template_build(const struct qr_image *qr, const struct encoded_msg *em)
+{
+	struct qr_image tmpl = *qr;
+	size_t size = qr->stride * qr->width;
+	u8 x, y;
+
+	tmpl.data = qr_template.image;
+	memset(qr_template.image, 0, size);
+	qr_image_draw_finders(&tmpl);
+	qr_image_draw_alignments(&tmpl);
+	qr_image_draw_timing_patterns(&tmpl);
+	qr_image_draw_version_info(&tmpl);
+
+	memset(qr_template.reserved, 0, size);
+	for (y = 0; y < qr->width; y++) {
+		for (x = 0; x < qr->width; x++) {
+			if (qr_image_is_reserved(qr, x, y))
+				qr_template.reserved[y * qr->stride + x / 8] |= 0x80 >> (x % 8);
+		}
+		/* Padding bits after the last module of the row */
+		qr_template.reserved[y * qr->stride + qr->stride - 1] |= 0xFF >> (qr->width % 8 ? qr->width % 8 : 8);
+	}
+
+	qr_template_place(&tmpl, em);
+	qr_template.version = qr->version.version;
+	qr_template.ec_level = qr->version.ec_level;
+}
+
 /**
  * qr_image_is_last() - Check if coordinates are at the last module
  * @qr: QR image
@@ -1520,88 +1906,434 @@ static void qr_image_next_available(const struct qr_image *qr, u8 *x, u8 *y)
 {
 	qr_image_next(qr, x, y);
 	
-	while (qr_image_is_reserved(qr, *x, *y) && !qr_image_is_last(qr, *x, *y)) {
+	while (qr_image_reserved(qr, *x, *y) && !qr_image_is_last(qr, *x, *y)) {
 		qr_image_next(qr, x, y);
 	}
 }
 
 /**
- * qr_image_draw_data() - Draw data modules
- * @qr: QR image
- * @iter: Iterator for encoded message
+ * qr_template_place() - Fill in the placement map of qr_template
+ * @tmpl: QR image drawing into qr_template.image, with the reserved bitmap
+ * @em: Encoded message of the same version
+ *
+ * Walks the zigzag once, recording where each bit of the interleaved message
+ * goes and whether mask 0 inverts it. The remainder bits after the message
+ * are always 0, so they are drawn into the template right away.
  */
-static void qr_image_draw_data(struct qr_image *qr, struct encoded_msg_iterator *iter)
+static void qr_template_place(struct qr_image *tmpl, const struct encoded_msg *em)
 {
-	u8 x = qr->width - 1;
-	u8 y = qr->width - 1;
-	u8 byte;
+	size_t size = encoded_msg_size(em);
+	size_t pos, src;
+	u8 x = tmpl->width - 1;
+	u8 y = tmpl->width - 1;
+	u16 entry;
 	int bit;
 	
-	/* Fill in data bits */
-	while (encoded_msg_iterator_next(iter, &byte)) {
-		for (bit = 7; bit >= 0; bit--) {
-			/* If bit is 0, set the module (since our set() makes it light) */
-			if (!(byte & (1 << bit))) {
-				qr_image_set(qr, x, y);
-			}
+	tmpl->reserved = qr_template.reserved;
+	
+	for (pos = 0; pos < size; pos++) {
+		src = encoded_msg_interleave(em, pos) * 8;
+		for (bit = 0; bit < 8; bit++) {
+			entry = y * tmpl->stride * 8 + x;
+			/* Mask 0 inverts modules with an even x + y */
+			if ((x ^ y) % 2)
+				entry |= QR_PLACE_UNMASKED;
+			qr_template.placement[src + bit] = entry;
 			
-			if (!qr_image_is_last(qr, x, y)) {
-				qr_image_next_available(qr, &x, &y);
-			} else {
-				break;
-			}
+			if (qr_image_is_last(tmpl, x, y))
+				return;
+			qr_image_next_available(tmpl, &x, &y);
 		}
 	}
 	
-	/* Set the remaining modules (if any) */
-	while (!qr_image_is_last(qr, x, y)) {
-		if (!qr_image_is_reserved(qr, x, y)) {
-			qr_image_set(qr, x, y);
-		}
-		qr_image_next(qr, &x, &y);
+	/* Set the remaining modules (if any), light when the mask leaves them */
+	while (!qr_image_is_last(tmpl, x, y)) {
+		if (!qr_image_reserved(tmpl, x, y) && (x ^ y) % 2)
+			qr_image_set(tmpl, x, y);
+		qr_image_next(tmpl, &x, &y);
 	}
 }
 
 /**
- * qr_image_apply_mask() - Apply checkerboard mask (pattern 0)
+ * qr_image_draw_data() - Draw the masked data modules
  * @qr: QR image
+ * @em: Encoded message
  */
-static void qr_image_apply_mask(struct qr_image *qr)
+static void qr_image_draw_data(struct qr_image *qr, const struct encoded_msg *em)
 {
-	for (u8 x = 0; x < qr->width; x++) {
-		for (u8 y = 0; y < qr->width; y++) {
-			if ((x ^ y) % 2 == 0 && !qr_image_is_reserved(qr, x, y)) {
-				qr_image_xor(qr, x, y);
+	const u16 *place = qr_template.placement;
+	size_t size = encoded_msg_size(em);
+	size_t i;
+	u16 entry;
+	u8 byte, light;
+	int bit;
+	
+	for (i = 0; i < size; i++) {
+		byte = em->data[i];
+		for (bit = 0; bit < 8; bit++, byte <<= 1) {
+			entry = *place++;
+			/* No branch, it would mispredict on every other random data bit */
+			light = (byte >> 7) ^ (entry >> 15);
+			entry &= QR_PLACE_POS_MASK;
+			qr->data[entry / 8] |= (light << 7) >> (entry % 8);
+		}
+	}
+}
+
+/*
+ * Mask patterns, with a bit set for every module the mask inverts, for each
+ * row modulo 12. All eight repeat every 12 rows and 6 columns.
+ */
+static u8 qr_mask_rows[8][12][MAX_STRIDE];
+static bool qr_mask_rows_ready;
+
+/**
+ * qr_mask_inverts() - Check if a mask inverts a module
+ * @mask: Mask pattern (0-7)
+ * @x: X coordinate
+ * @y: Y coordinate
+ *
+ * Return: true if the module is inverted, as defined by ISO 18004
+ */
+static bool qr_mask_inverts(u8 mask, unsigned int x, unsigned int y)
+{
+	switch (mask) {
+	case 0:
+		return (x + y) % 2 == 0;
+	case 1:
+		return y % 2 == 0;
+	case 2:
+		return x % 3 == 0;
+	case 3:
+		return (x + y) % 3 == 0;
+	case 4:
+		return (y / 2 + x / 3) % 2 == 0;
+	case 5:
+		return (x * y) % 2 + (x * y) % 3 == 0;
+	case 6:
+		return ((x * y) % 2 + (x * y) % 3) % 2 == 0;
+	default:
+		return ((x + y) % 2 + (x * y) % 3) % 2 == 0;
+	}
+}
+
+/**
+ * qr_mask_rows_build() - Fill qr_mask_rows
+ */
+static void qr_mask_rows_build(void)
+{
+	unsigned int mask, y, x;
+	
+	memset(qr_mask_rows, 0, sizeof(qr_mask_rows));
+	for (mask = 0; mask < 8; mask++) {
+		for (y = 0; y < 12; y++) {
+			for (x = 0; x < MAX_STRIDE * 8; x++) {
+				if (qr_mask_inverts(mask, x, y))
+					qr_mask_rows[mask][y][x / 8] |= 0x80 >> (x % 8);
 			}
 		}
 	}
+	qr_mask_rows_ready = true;
 }
 
 /**
- * qr_image_draw() - Draw complete QR code
+ * qr_image_remask() - Switch the mask of the data modules
  * @qr: QR image
- * @em: Encoded message
+ * @data: Image buffer, masked with @from
+ * @from: Current mask (0-7)
+ * @to: New mask (0-7)
+ */
+static void qr_image_remask(const struct qr_image *qr, u8 *data, u8 from, u8 to)
+{
+	const u8 *a, *b;
+	size_t row, i, off;
+	
+	for (row = 0; row < qr->width; row++) {
+		a = qr_mask_rows[from][row % 12];
+		b = qr_mask_rows[to][row % 12];
+		off = row * qr->stride;
+		for (i = 0; i < qr->stride; i++)
+			data[off + i] ^= (a[i] ^ b[i]) & ~qr->reserved[off + i];
+	}
+}
+
+/*
+ * Penalty scoring works on whole lines of modules at once, as 192-bit
+ * words with the first module in the most significant bit. The line starts
+ * at bit QR_LINE_PAD, after the light quiet zone that finder-like patterns
+ * may lean on.
+ */
+#define QR_LINE_WORDS 3
+#define QR_LINE_PAD 4
+
+struct qr_line {
+	u64 w[QR_LINE_WORDS];
+};
+
+/* Shift towards the most significant bit: bit x then holds module x + @k */
+static struct qr_line qr_line_shl(struct qr_line a, unsigned int k)
+{
+	struct qr_line r;
+	
+	if (!k)
+		return a;
+	r.w[0] = a.w[0] << k | a.w[1] >> (64 - k);
+	r.w[1] = a.w[1] << k | a.w[2] >> (64 - k);
+	r.w[2] = a.w[2] << k;
+	return r;
+}
+
+/* Shift towards the least significant bit by one: bit x then holds module x - 1 */
+static struct qr_line qr_line_shr1(struct qr_line a)
+{
+	struct qr_line r;
+	
+	r.w[0] = a.w[0] >> 1;
+	r.w[1] = a.w[1] >> 1 | a.w[0] << 63;
+	r.w[2] = a.w[2] >> 1 | a.w[1] << 63;
+	return r;
+}
+
+static struct qr_line qr_line_and(struct qr_line a, struct qr_line b)
+{
+	int k;
+	
+	for (k = 0; k < QR_LINE_WORDS; k++)
+		a.w[k] &= b.w[k];
+	return a;
+}
+
+static struct qr_line qr_line_andnot(struct qr_line a, struct qr_line b)
+{
+	int k;
+	
+	for (k = 0; k < QR_LINE_WORDS; k++)
+		a.w[k] &= ~b.w[k];
+	return a;
+}
+
+static struct qr_line qr_line_xor(struct qr_line a, struct qr_line b)
+{
+	int k;
+	
+	for (k = 0; k < QR_LINE_WORDS; k++)
+		a.w[k] ^= b.w[k];
+	return a;
+}
+
+static unsigned int qr_line_weight(struct qr_line a)
+{
+	return hweight64(a.w[0]) + hweight64(a.w[1]) + hweight64(a.w[2]);
+}
+
+/**
+ * qr_line_load() - Load the dark modules of a line of the image
+ * @line: Image row, a set bit is a light module
+ * @stride: Bytes per row
+ * @valid: Modules inside the code
+ *
+ * Return: line with a bit set for every dark module
+ */
+static struct qr_line qr_line_load(const u8 *line, u8 stride, struct qr_line valid)
+{
+	struct qr_line r = {};
+	size_t i;
+	
+	for (i = 0; i < stride; i++)
+		r.w[i / 8] |= (u64)line[i] << (56 - (i % 8) * 8);
+	/* Make room for the quiet zone */
+	r.w[2] = r.w[2] >> QR_LINE_PAD | r.w[1] << (64 - QR_LINE_PAD);
+	r.w[1] = r.w[1] >> QR_LINE_PAD | r.w[0] << (64 - QR_LINE_PAD);
+	r.w[0] >>= QR_LINE_PAD;
+	return qr_line_andnot(valid, r);
+}
+
+/* A run of n >= 5 modules of one colour sets n - 4 bits, and costs n - 2 */
+static unsigned int qr_line_runs(struct qr_line run)
+{
+	return qr_line_weight(run) + 2 * qr_line_weight(qr_line_andnot(run, qr_line_shr1(run)));
+}
+
+/**
+ * qr_line_penalty() - Score runs and finder-like patterns in a line
+ * @dark: Dark modules of the line
+ * @valid: Modules inside the code
+ *
+ * Return: N1 (3 for a run of 5 modules of the same colour, 1 more for every
+ *         module past 5) plus N3 (40 for every 1:1:3:1:1 dark:light pattern
+ *         with 4 light modules on one side, outside the code counting as
+ *         light)
+ */
+static unsigned int qr_line_penalty(struct qr_line dark, struct qr_line valid)
+{
+	struct qr_line light = qr_line_andnot(valid, dark);
+	struct qr_line d[7], run, core, light4;
+	unsigned int penalty = 0, k, c;
+	
+	/* d[k] has bit x set if module x + k is dark */
+	d[0] = dark;
+	for (k = 1; k < 7; k++)
+		d[k] = qr_line_shl(dark, k);
+	
+	/* N1: bit x of run is set if modules x to x + 4 have the same colour */
+	run = qr_line_and(qr_line_and(d[0], d[1]), qr_line_and(d[2], d[3]));
+	run = qr_line_and(run, d[4]);
+	penalty += qr_line_runs(run);
+	run = qr_line_and(light, qr_line_shl(light, 1));
+	run = qr_line_and(run, qr_line_shl(run, 2));
+	run = qr_line_and(run, qr_line_shl(light, 4));
+	penalty += qr_line_runs(run);
+	
+	/* N3: dark, light, 3 dark, light, dark, then 4 light after or before */
+	core = qr_line_andnot(qr_line_and(qr_line_and(d[0], d[2]), qr_line_and(d[3], d[4])), d[1]);
+	core = qr_line_andnot(qr_line_and(core, d[6]), d[5]);
+	/* Everything but dark counts as light here, including the quiet zone */
+	for (c = 0; c < QR_LINE_WORDS; c++)
+		light4.w[c] = ~(d[0].w[c] | d[1].w[c] | d[2].w[c] | d[3].w[c]);
+	penalty += 40 * qr_line_weight(qr_line_and(core, qr_line_shl(light4, 7)));
+	penalty += 40 * qr_line_weight(qr_line_and(light4, qr_line_shl(core, 4)));
+	
+	return penalty;
+}
+
+/**
+ * qr_transpose() - Transpose a 1-bpp image
+ * @dst: Destination, the columns of @src as rows
+ * @src: Source image
+ * @width: Width of the image in modules
+ * @stride: Bytes per row of both images
+ *
+ * Works on 8x8 module tiles, transposed as 64-bit words.
+ */
+static void qr_transpose(u8 *dst, const u8 *src, u8 width, u8 stride)
+{
+	size_t bx, by, i;
+	u64 x, t;
+	
+	for (by = 0; by < stride; by++) {
+		for (bx = 0; bx < stride; bx++) {
+			x = 0;
+			for (i = 0; i < 8 && by * 8 + i < width; i++)
+				x |= (u64)src[(by * 8 + i) * stride + bx] << (56 - i * 8);
+			
+			t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+			x ^= t ^ (t << 7);
+			t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+			x ^= t ^ (t << 14);
+			t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+			x ^= t ^ (t << 28);
+			
+			for (i = 0; i < 8 && bx * 8 + i < width; i++)
+				dst[(bx * 8 + i) * stride + by] = x >> (56 - i * 8);
+		}
+	}
+}
+
+/* Scratch images for scoring masks */
+static u8 qr_mask_image[MAX_IMAGE_SIZE];
+static u8 qr_mask_columns[MAX_IMAGE_SIZE];
+
+/**
+ * qr_image_penalty() - Compute the ISO 18004 penalty of an image
+ * @qr: QR image, with its format info
+ * @rows_only: Leave out N1 and N3 of the columns
+ *
+ * Return: N1 + N2 + N3 + N4 penalty
  */
-static void qr_image_draw(struct qr_image *qr, const struct encoded_msg *em)
+static unsigned int qr_image_penalty(const struct qr_image *qr, bool rows_only)
 {
-	struct encoded_msg_iterator iter;
+	struct qr_line valid = {}, dark, prev = {}, same, block;
+	unsigned int penalty = 0, dark_count = 0, total = qr->width * qr->width;
+	size_t y, k;
 	
-	/* Clear the image */
-	memset(qr->data, 0, qr->stride * qr->width);
+	for (k = QR_LINE_PAD; k < QR_LINE_PAD + qr->width; k++)
+		valid.w[k / 64] |= 1ULL << (63 - k % 64);
 	
-	/* Draw fixed patterns */
-	qr_image_draw_finders(qr);
-	qr_image_draw_alignments(qr);
-	qr_image_draw_timing_patterns(qr);
-	qr_image_draw_version_info(qr);
+	for (y = 0; y < qr->width; y++) {
+		dark = qr_line_load(qr->data + y * qr->stride, qr->stride, valid);
+		penalty += qr_line_penalty(dark, valid);
+		dark_count += qr_line_weight(dark);
+		
+		/* N2: 3 for every 2x2 block of the same colour */
+		if (y) {
+			same = qr_line_andnot(valid, qr_line_xor(dark, prev));
+			block = qr_line_and(same, qr_line_shl(same, 1));
+			block = qr_line_andnot(block, qr_line_xor(dark, qr_line_shl(dark, 1)));
+			penalty += 3 * qr_line_weight(block);
+		}
+		prev = dark;
+	}
 	
-	/* Draw data */
-	encoded_msg_iterator_init(&iter, em);
-	qr_image_draw_data(qr, &iter);
+	if (!rows_only) {
+		qr_transpose(qr_mask_columns, qr->data, qr->width, qr->stride);
+		for (y = 0; y < qr->width; y++) {
+			dark = qr_line_load(qr_mask_columns + y * qr->stride, qr->stride, valid);
+			penalty += qr_line_penalty(dark, valid);
+		}
+	}
 	
-	/* Draw format info and apply mask */
-	qr_image_draw_maskinfo(qr);
-	qr_image_apply_mask(qr);
+	/* N4: 10 for every 5% the dark modules are away from half */
+	penalty += 10 * (abs((int)(dark_count * 2) - (int)total) * 10 / total);
+	
+	return penalty;
+}
+
+/**
+ * qr_image_best_mask() - Find the mask with the lowest penalty
+ * @qr: QR image with the data drawn with mask 0, without format info
+ * @rows_only: Score the rows only, see qr_image_penalty()
+ *
+ * Return: Best mask (0-7), the lowest one on a tie
+ */
+static u8 qr_image_best_mask(const struct qr_image *qr, bool rows_only)
+{
+	struct qr_image cand = *qr;
+	unsigned int penalty, best_penalty = UINT_MAX;
+	size_t size = qr->stride * qr->width;
+	u8 mask, best = 0;
+	
+	cand.data = qr_mask_image;
+	for (mask = 0; mask < 8; mask++) {
+		memcpy(cand.data, qr->data, size);
+		if (mask)
+			qr_image_remask(&cand, cand.data, 0, mask);
+		qr_image_draw_maskinfo(&cand, mask);
+		
+		penalty = qr_image_penalty(&cand, rows_only);
+		if (penalty < best_penalty) {
+			best_penalty = penalty;
+			best = mask;
+		}
+	}
+	return best;
+}
+
+/**
+ * qr_image_draw() - Draw complete QR code
+ * @qr: QR image
+ * @em: Encoded message
+ * @mask: Mask pattern (0-7), QR_MASK_BEST or QR_MASK_FAST
+ */
+static void qr_image_draw(struct qr_image *qr, const struct encoded_msg *em, int mask)
+{
+	/* Start from the fixed patterns of this version */
+	if (qr_template.version != qr->version.version ||
+	    qr_template.ec_level != qr->version.ec_level)
+		qr_template_build(qr, em);
+	memcpy(qr->data, qr_template.image, qr->stride * qr->width);
+	qr->reserved = qr_template.reserved;
+	
+	/* Draw data, masked with mask 0 */
+	qr_image_draw_data(qr, em);
+	
+	/* Switch to the chosen mask, then draw its format info */
+	if (!qr_mask_rows_ready)
+		qr_mask_rows_build();
+	if (mask < 0 || mask > 7)
+		mask = qr_image_best_mask(qr, mask == QR_MASK_FAST);
+	if (mask)
+		qr_image_remask(qr, qr->data, 0, mask);
+	qr_image_draw_maskinfo(qr, mask);
 }
 
 /**
@@ -1611,6 +2343,10 @@ static void qr_image_draw(struct qr_image *qr, const struct encoded_msg *em)
  * @data: A pointer to the binary data to be encoded. If URL is not NULL, it
  *        will be encoded efficiently as a numeric segment and appended to the URL.
  * @data_len: Length of the data that needs to be encoded, must be less than data_size.
+ * @qr_version: The specific QR version to use (1-40)
+ * @ec_level: Error correction level, QR_ECC_L to QR_ECC_H
+ * @mask: Mask pattern (0-7), or QR_MASK_BEST / QR_MASK_FAST to pick one
+ * @append: Position of the code in a Structured Append series, NULL if none
  * @data_size: Size of data buffer, at least 4071 bytes to hold a V40 QR code.
  *             It will be overwritten with the QR code image.
  * @tmp: A temporary buffer that the QR code encoder will use to write the
@@ -1623,12 +2359,16 @@ u8 qr_generate(const char *url,
               u8 *data,
               size_t data_len,
               u8 qr_version,
+              u8 ec_level,
+              int mask,
+              const struct qr_structured_append *append,
               size_t data_size,
               u8 *tmp,
               size_t tmp_size)
 {
-	struct qr_segment binary_segment, numeric_segment;
-	const struct qr_segment *segments[2];
+	struct qr_segment append_segment, binary_segment, numeric_segment;
+	const struct qr_segment *segments[3];
+	u8 append_data[2];
 	size_t count = 0;
 	struct encoded_msg em;
 	struct qr_image qr;
@@ -1643,6 +2383,21 @@ u8 qr_generate(const char *url,
 		return 0;
 	}
 	
+	/* The Structured Append header goes first, ahead of any mode */
+	if (append) {
+		if (append->total < 1 || append->total > 16 || append->index >= append->total) {
+			pr_err("qr_generator: Invalid Structured Append position %u of %u\n",
+			       append->index, append->total);
+			return 0;
+		}
+		append_data[0] = (append->index << 4) | (append->total - 1);
+		append_data[1] = append->parity;
+		append_segment.type = SEGMENT_STRUCTURED_APPEND;
+		append_segment.data = append_data;
+		append_segment.length = sizeof(append_data);
+		segments[count++] = &append_segment;
+	}
+	
 	/* Setup segments according to parameters */
 	if (url) {
 		/* Create binary segment for URL */
@@ -1665,7 +2420,7 @@ u8 qr_generate(const char *url,
 	}
 	
 	/* Initialize and encode the message */
-	if (!encoded_msg_init(&em, segments, count, qr_version, tmp, tmp_size))
+	if (!encoded_msg_init(&em, segments, count, qr_version, ec_level, tmp, tmp_size))
 		return 0;
 	
 	encoded_msg_encode(&em, segments, count);
@@ -1674,7 +2429,7 @@ u8 qr_generate(const char *url,
 	if (!qr_image_init(&qr, &em, data, data_size))
 		return 0;
 	
-	qr_image_draw(&qr, &em);
+	qr_image_draw(&qr, &em, mask);
 	
 	return qr.width;
 }
@@ -1683,37 +2438,134 @@ EXPORT_SYMBOL_GPL(qr_generate);
 /**
  * qr_max_data_size() - Calculate the maximum data size for a QR version
  * @version: QR code version (1-40)
+ * @ec_level: Error correction level, QR_ECC_L to QR_ECC_H
  * @url_len: Length of the URL (0 if not using URL)
+ * @structured_append: Whether the code carries a Structured Append header
  *
- * Return: Maximum number of bytes that can be encoded, or 0 if version is invalid.
+ * Return: Maximum number of bytes that can be encoded, or 0 if version or
+ * level is invalid.
  */
-size_t qr_max_data_size(u8 version, size_t url_len)
+size_t qr_max_data_size(u8 version, u8 ec_level, size_t url_len, bool structured_append)
 {
 	struct qr_version ver;
 	size_t max_data;
 	size_t max;
+	size_t header;
 	
-	if (version < 1 || version > 40)
+	if (version < 1 || version > 40 || ec_level > QR_ECC_H)
 		return 0;
 	
 	ver.version = version;
+	ver.ec_level = ec_level;
 	max_data = qr_version_max_data(ver);
 	
 	if (url_len > 0) {
-		/* Binary segment (URL) 4 + 16 bits, numeric segment (kmsg) 4 + 12 bits => 5 bytes */
-		if (url_len + 5 >= max_data)
+		/* Binary segment (URL) 4 + 16 bits, numeric segment (kmsg) 4 + 12 bits => 5 bytes,
+		 * and 20 more bits for Structured Append => 8 bytes
+		 */
+		header = structured_append ? 8 : 5;
+		if (url_len + header >= max_data)
 			return 0;
 		
 		/* Include 2.5% overhead for the numeric encoding */
-		max = max_data - url_len - 5;
+		max = max_data - url_len - header;
 		return (max * 39) / 40;
 	} else {
-		/* Remove 3 bytes for binary segment (header 4 bits, length 16 bits, stop 4 bits) */
-		return max_data - 3;
+		/* Remove 3 bytes for binary segment (header 4 bits, length 16 bits, stop 4 bits),
+		 * 6 with Structured Append (mode 4 bits, position 8 bits, parity 8 bits)
+		 */
+		return max_data - (structured_append ? 6 : 3);
 	}
 }
 EXPORT_SYMBOL_GPL(qr_max_data_size);
 
+static u8 qr_selftest_ref[MAX_MSG_SIZE] __initdata;
+static u8 qr_selftest_buf[MAX_MSG_SIZE] __initdata;
+static u8 qr_init_image[MAX_IMAGE_SIZE] __initdata;
+
+/**
+ * qr_rs_selftest() - Check a vector kernel against the scalar one
+ * @impl: Vector kernel
+ *
+ * Computes the error correction of pseudo-random data for every version
+ * and level with both kernels.
+ *
+ * Return: true if they agree on every version and level
+ */
+static bool __init qr_rs_selftest(const struct qr_rs_impl *impl)
+{
+	struct encoded_msg em;
+	struct qr_version version;
+	u32 seed = 1;
+	size_t i, j, max_data;
+	bool ok = true;
+	
+	if (!may_use_simd())
+		return false;
+	
+	for (i = 0; i < 4 * 40 && ok; i++) {
+		version.ec_level = i / 40;
+		version.version = i % 40 + 1;
+		max_data = qr_version_max_data(version);
+		em.ec_size = qr_version_ec_size(version);
+		em.g1_blocks = qr_version_g1_blocks(version);
+		em.g2_blocks = qr_version_g2_blocks(version);
+		em.g1_blk_size = qr_version_g1_blk_size(version);
+		em.g2_blk_size = em.g1_blk_size + 1;
+		em.poly = qr_version_poly(version);
+		em.version = version;
+		
+		for (j = 0; j < max_data; j++) {
+			seed = seed * 1103515245 + 12345;
+			qr_selftest_ref[j] = seed >> 16;
+		}
+		memcpy(qr_selftest_buf, qr_selftest_ref, max_data);
+		
+		em.data = qr_selftest_ref;
+		encoded_msg_error_code_with(&em, NULL);
+		
+		em.data = qr_selftest_buf;
+		encoded_msg_error_code_with(&em, impl);
+		
+		ok = !memcmp(qr_selftest_ref, qr_selftest_buf, max_data + em.ec_size *
+			     (em.g1_blocks + em.g2_blocks));
+	}
+	
+	if (!ok)
+		pr_err("qr_generator: %s Reed-Solomon differs from scalar on version %u, level %u\n",
+		       impl->name, version.version, version.ec_level);
+	return ok;
+}
+
+/**
+ * qr_generator_init() - Pick the Reed-Solomon kernel and build the tables
+ * @version: QR version the codes will use (1-40), 0 if not known yet
+ * @ec_level: Error correction level the codes will use
+ *
+ * The first vector kernel the CPU supports is used if it passes
+ * qr_rs_selftest(), the scalar kernel otherwise. An empty code of @version
+ * is then generated, which leaves its template, Reed-Solomon products and
+ * mask rows built, so the first real code does not pay for them.
+ */
+void __init qr_generator_init(u8 version, u8 ec_level)
+{
+	size_t i;
+	
+	for (i = 0; i < ARRAY_SIZE(qr_rs_impls); i++) {
+		if (!qr_rs_impls[i].usable())
+			continue;
+		if (qr_rs_selftest(&qr_rs_impls[i])) {
+			qr_rs_simd = &qr_rs_impls[i];
+			pr_info("qr_generator: Using %s Reed-Solomon\n", qr_rs_simd->name);
+		}
+		break;
+	}
+	
+	if (version)
+		qr_generate(NULL, qr_init_image, 0, version, ec_level, 0, NULL,
+			    sizeof(qr_init_image), qr_selftest_buf, sizeof(qr_selftest_buf));
+}
+
 MODULE_AUTHOR("Certainly written by AI");
 MODULE_DESCRIPTION("QR Code Generator Library");
 MODULE_LICENSE("GPL");
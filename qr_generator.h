@@ -3,9 +3,10 @@
 /*
  * QR Code Generator Library Header
  *
- * This is a simple QR encoder that doesn't allocate memory and does all the work
- * on the stack or on the provided buffers. For simplification, it only supports
- * low error correction, and applies the first mask (checkerboard).
+ * This is a simple QR encoder that doesn't allocate memory. Besides the stack
+ * and the provided buffers, it keeps about 90 KB of static tables, so calls
+ * must be serialized. It supports the four error correction levels. The mask
+ * is either fixed or the one with the lowest ISO 18004 penalty.
  *
  */
 
@@ -18,6 +19,34 @@
 extern "C" {
 #endif
 
+/*
+ * Error correction levels, from most data to most redundancy. Each restores
+ * roughly 7%, 15%, 25% and 30% of damaged codewords.
+ */
+#define QR_ECC_L 0
+#define QR_ECC_M 1
+#define QR_ECC_Q 2
+#define QR_ECC_H 3
+
+/* Mask choices for qr_generate(), besides a fixed mask 0-7 */
+#define QR_MASK_BEST -1 /* Lowest penalty of all eight masks */
+#define QR_MASK_FAST -2 /* Lowest penalty counting the rows only, half the work */
+
+/**
+ * struct qr_structured_append - Position of a code in a Structured Append series
+ * @index: Position of this code in the series (0-15)
+ * @total: Number of codes in the series (1-16)
+ * @parity: XOR of all the data bytes of all the codes in the series
+ *
+ * Scanners that support Structured Append put the data of the series back
+ * together in order, whatever order the codes were scanned in.
+ */
+struct qr_structured_append {
+	u8 index;
+	u8 total;
+	u8 parity;
+};
+
 /**
  * qr_generate() - Generate a QR code from the provided data
  * @url: The base URL of the QR code. It will be encoded as Binary segment.
@@ -31,6 +60,13 @@ extern "C" {
  *       segments and ECC.
  * @tmp_size: Size of the temporary buffer, must be at least 3706 bytes for V40.
  * @qr_version: The specific QR version to use (1-40)
+ * @ec_level: Error correction level, QR_ECC_L to QR_ECC_H. Higher levels
+ *            survive more glare and blur, but hold less data.
+ * @mask: Mask pattern (0-7), or QR_MASK_BEST / QR_MASK_FAST to pick the one
+ *        with the lowest ISO 18004 penalty. Large areas of one colour and
+ *        patterns resembling the finders make codes harder to scan.
+ * @append: Position of the code in a Structured Append series, or NULL for
+ *          a code on its own. Takes 20 bits, see qr_max_data_size().
  *
  * This function generates a QR code containing the provided data. If a URL is 
  * provided, it is encoded as a Binary segment, and the data is encoded as a 
@@ -44,12 +80,21 @@ extern "C" {
  * The temporary buffer is used for internal operations and must be at least 3706
  * bytes for a V40 QR code.
  *
+ * The encoder keeps the function patterns and data placement of the last
+ * version and level, Reed-Solomon products and the images of the mask search
+ * in static memory. It is not reentrant: callers must serialize calls to
+ * qr_generate(), and with qr_generator_init(). The tables of another version
+ * or level are rebuilt on the first call that uses it.
+ *
  * Return: Width of the QR code (each side in pixels) or 0 if encoding failed.
  */
 u8 qr_generate(const char *url,
                u8 *data,
                size_t data_len,
                u8 qr_version,
+               u8 ec_level,
+               int mask,
+               const struct qr_structured_append *append,
                size_t data_size,
                u8 *tmp,
                size_t tmp_size);
@@ -57,19 +102,35 @@ u8 qr_generate(const char *url,
 /**
  * qr_max_data_size() - Calculate the maximum data size for a QR version
  * @version: QR code version (1-40)
+ * @ec_level: Error correction level, QR_ECC_L to QR_ECC_H
  * @url_len: Length of the URL (0 if not using URL)
+ * @structured_append: Whether the code carries a Structured Append header
  *
  * This function calculates the maximum number of bytes that can be encoded in a QR
- * code of the specified version, taking into account the overhead of encoding the
+ * code of the specified version and error correction level, taking into account the overhead of encoding the
  * URL (if provided) and the segment headers.
  *
  * If url_len > 0, the function accounts for both Binary segment (URL) and Numeric
  * segment (data) headers. If url_len = 0, it only accounts for one Binary segment
  * header.
  *
- * Return: Maximum number of data bytes that can be encoded, or 0 if version is invalid.
+ * Return: Maximum number of data bytes that can be encoded, or 0 if version or
+ * level is invalid.
+ */
+size_t qr_max_data_size(u8 version, u8 ec_level, size_t url_len, bool structured_append);
+
+/**
+ * qr_generator_init() - Set up the QR code generator
+ * @version: QR version the codes will use (1-40), 0 if not known yet
+ * @ec_level: Error correction level the codes will use, QR_ECC_L to QR_ECC_H
+ *
+ * Picks the fastest Reed-Solomon kernel the CPU supports, after checking it
+ * against the scalar one, and builds the tables of @version and @ec_level,
+ * so that the first qr_generate() of that version, typically at panic, does
+ * not have to. Call it once before the first qr_generate(); if it is not
+ * called, the scalar kernel is used and the tables are built on first use.
  */
-size_t qr_max_data_size(u8 version, size_t url_len);
+void qr_generator_init(u8 version, u8 ec_level);
 
 #ifdef __cplusplus
 }
@@ -5,8 +5,25 @@
  * as a sequence of QR codes during a system panic.
  *
  * It captures messages using the kmsg_dump mechanism, compresses them
- * using ZSTD, determines the optimal data size for the configured QR version
- * using a binary search, and renders the resulting QR codes.
+ * using ZSTD (or LZ4/LZ4HC), determines how much data fits the configured QR version
+ * with a streaming pass and a short refinement, and renders the resulting
+ * QR codes.
+ *
+ * With runtime capture enabled, new kmsg records are mirrored into the history
+ * buffer by a periodic work item, so that the panic path only has to collect
+ * the records printed since the last drain. The same work item compresses
+ * the captured history into ready QR payloads, so that at panic only the
+ * uncommitted tail has to be compressed.
+ *
+ * Payloads can be compressed against a built-in dictionary generated by
+ * train_dict.py (see qrcon_dict.h), whose ID is recorded in each header.
+ * Captured records are split into level, timestamp, sequence number and text
+ * columns first, so that decode.py can restore them and report lost messages.
+ * When built in with CONFIG_PRINTK_INDEX, records printed from a known format
+ * are sent as a reference to it plus the output of its conversions, and call
+ * trace frames as addresses that decode.py symbolizes with System.map.
+ * In stream mode the whole history is compressed as one zstd frame instead,
+ * split into sequenced pieces that are reassembled by decode.py.
  */
 
 #include <linux/module.h>
@@ -17,14 +34,93 @@
 #include <linux/kmsg_dump.h>
 #include <linux/delay.h>
 #include <linux/zstd.h>
+#include <linux/lz4.h>
 #include <linux/panic_notifier.h>
 #include <linux/reboot.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/jhash.h>
+#include <linux/ctype.h>
+#include <linux/kallsyms.h>
+#include <linux/mm.h>
+#include <linux/crc32.h>
+#include <linux/random.h>
+#include <asm/sections.h>
 #include "qr_generator.h"
-
-static int qr_version = 20; // around ~842 bytes (1-40)
+#include "qrcon_dict.h"
+
+/* The printk index section is only reachable from built-in code */
+#if IS_BUILTIN(CONFIG_QRCON) && IS_ENABLED(CONFIG_PRINTK_INDEX)
+#define QRCON_PRINTK_INDEX
+#endif
+/* So is kallsyms_lookup_name() */
+#if IS_BUILTIN(CONFIG_QRCON) && IS_ENABLED(CONFIG_KALLSYMS)
+#define QRCON_TRACE_SYMBOLS
+#endif
+/* Screens to draw on: fbdev, and DRM drivers that support drm_panic */
+#if IS_REACHABLE(CONFIG_FB)
+#define QRCON_FBDEV
+#endif
+#if IS_REACHABLE(CONFIG_DRM) && IS_ENABLED(CONFIG_DRM_PANIC)
+#define QRCON_DRM_PANIC
+#include <linux/fs.h>
+#include <linux/version.h>
+#include <drm/drm_device.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_file.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_modeset_helper_vtables.h>
+#include <drm/drm_panic.h>
+#include <drm/drm_plane.h>
+#endif
+/* The framebuffer left by the firmware, for panics before any driver probed */
+#if IS_BUILTIN(CONFIG_QRCON) && (defined(CONFIG_X86) || IS_ENABLED(CONFIG_SCREEN_INFO))
+#define QRCON_SCREEN_INFO
+#include <linux/screen_info.h>
+#endif
+#if IS_BUILTIN(CONFIG_QRCON) && IS_ENABLED(CONFIG_OF_ADDRESS)
+#define QRCON_SIMPLE_FB
+#include <linux/of.h>
+#include <linux/of_address.h>
+#endif
+#if defined(QRCON_SCREEN_INFO) || defined(QRCON_SIMPLE_FB)
+#define QRCON_FIRMWARE_FB
+#include <linux/io.h>
+#include <linux/platform_device.h>
+#endif
+
+/* Pick the QR version from the framebuffer size, see qrcon_auto_version() */
+#define QR_VERSION_AUTO 0
+
+static int qr_version = 20; // around ~842 bytes (1-40), or QR_VERSION_AUTO
+/* In auto mode, the largest version whose modules are at least this big on screen */
+static int qr_min_module_px = 4;
+static int qr_min_module_um = 400; // only if the panel reports its size, 0 to ignore
+/* QR_ECC_L to QR_ECC_H: higher levels hold less but scan better off glossy or blurry screens */
+static int qr_ecc = QR_ECC_L;
+/* Mask pattern 0-7, or QR_MASK_BEST / QR_MASK_FAST to score the masks per code */
+static int qr_mask = QR_MASK_BEST;
 static int qr_refresh_delay = 700; // in ms
 static int recent_only = 0;
 
+/* Mirror kmsg into the history buffer while the system is running */
+static int runtime_capture = 1;
+static int capture_interval = 1000; // in ms
+/* Compress captured history into ready QR payloads ahead of a panic */
+static int precompress = 1;
+/* Compress the whole history as one zstd stream split across QR codes.
+ * Denser for repetitive logs, but every code is needed to decode the rest.
+ */
+static int stream_mode = 0;
+/* Split records into level, timestamp, sequence and text columns before compressing */
+static int record_transform = 1;
+/* Send references to printk index formats instead of the text of records */
+static int printk_index = 1;
+/* Send call trace frames as addresses, symbolized by decode.py from System.map */
+static int trace_encoding = 1;
+/* Link up to QRCON_APPEND_MAX consecutive codes as an ISO Structured Append series */
+static int structured_append = 0;
+
 #define QRCON_RECENT_ONLY_SIZE 8096
 
 /* QR code positioning macros */
@@ -41,6 +137,10 @@ static int qr_x_offset = 0;
 static int qr_y_offset = 0;
 static int qr_size_percent = 100;
 static int qr_border = 5;
+/* Codes shown at once, side by side, or 0 for as many as fit with qr_min_module_px modules */
+static int qr_tiles = 1;
+/* Draw three codes per frame, one in each of the red, green and blue channels */
+static int qr_color = 0;
 
 /* Maximum size of kernel message history buffer to collect (10MB) */
 #define KMSG_HISTORY_BUF_SIZE (10 * 1024 * 1024)
@@ -51,30 +151,216 @@ static int qr_border = 5;
 #define QR_TMP_WORKSPACE_SIZE 4096
 
 /* Compression related defines */
-#define QR_COMPRESSION_MAGIC 0x5A535444  /* "ZSTD" */
-#define QR_COMPRESSION_HEADER_SIZE 8     /* 4 bytes magic + 4 bytes uncompressed size */
+#define QRCON_FRAME_MAGIC 0x4E435251  /* "QRCN" */
+#define QR_COMPRESSION_HEADER_SIZE sizeof(struct qrcon_frame_header)
 #define QR_SKIP_SIZE 1024  /* Bytes to skip on compression error */
 
-/* Sized generously to accommodate ZSTD level (8). roughly ~6.2MB workspace. */
-#define QRCON_ZSTD_WORKSPACE_SIZE (8 * 1024 * 1024)
+/* Header in front of every compressed payload, little-endian */
+struct qrcon_frame_header {
+    __le32 magic;       /* QRCON_FRAME_MAGIC */
+    __le32 size;        /* Uncompressed size */
+    __le16 dict_id;     /* QRCON_DICT_ID of the dictionary used, 0 for none */
+    u8 flags;           /* QRCON_FRAME_* */
+    u8 codec;           /* QRCON_CODEC_* */
+} __packed;
+
+/* Payload formats, as recorded in the frame header */
+#define QRCON_CODEC_ZSTD 0  /* zstd frame */
+#define QRCON_CODEC_LZ4  1  /* LZ4 block, from either LZ4 or LZ4HC */
+
+#define QRCON_FRAME_STREAM     (1 << 0) /* Piece of a stream, qrcon_stream_header follows */
+#define QRCON_FRAME_STREAM_END (1 << 1) /* Last piece of the stream */
+#define QRCON_FRAME_RECORDS    (1 << 2) /* Payload is column-packed records, see qrcon_records_pack() */
+#define QRCON_FRAME_PRINTK     (1 << 3) /* Records carry printk index references */
+#define QRCON_FRAME_TRACE      (1 << 4) /* Records carry call trace addresses */
+#define QRCON_FRAME_TILE       (1 << 5) /* qrcon_tile_header follows */
+
+/* Follows the frame header in stream mode. The frame header size is that
+ * of the whole stream; the pieces concatenated by offset form one zstd frame.
+ */
+struct qrcon_stream_header {
+    __le16 seq;         /* Piece number, from 0 */
+    __le32 offset;      /* Offset of this piece in the compressed stream */
+    __le16 id;          /* Random per boot, tells streams of different panics apart */
+} __packed;
+
+#define QRCON_STREAM_HEADER_SIZE (sizeof(struct qrcon_frame_header) + sizeof(struct qrcon_stream_header))
+
+/* Follows the frame header of frames shown in tiled mode, where several codes
+ * are on screen at once and get scanned in any order. Stream pieces have
+ * their own sequence number.
+ */
+struct qrcon_tile_header {
+    __le16 seq;         /* Frame number, from 0 */
+} __packed;
+
+/* Fill point search */
+#define QRCON_ZSTD_EPILOGUE_SIZE 3   /* Empty last block that ends a streamed frame */
+#define QRCON_FILL_WINDOW_RATIO 16   /* Max input per frame, as a multiple of the capacity */
+#define QRCON_FILL_MIN_STEP 64       /* Smallest input step between stream flushes */
+#define QRCON_FILL_SLACK 4           /* Unused payload bytes at which a frame counts as full */
+#define QRCON_FILL_GRANULE 8         /* Stop once the fill point is known to this many bytes */
+#define QRCON_FILL_MAX_TRIES 8       /* Single-shot compressions per frame */
+
+/* zstd tables are capped at this log, see qrcon_zstd_cparams() */
+#define QRCON_ZSTD_TABLE_LOG 14
+/* Largest window tried in stream mode, the workspace usually limits it first */
+#define QRCON_STREAM_WINDOW_LOG_MAX 22
+/* Holds the context for a V40 frame at level 8. Stream mode uses whatever
+ * window fits, so raising this makes stream mode denser.
+ */
+#define QRCON_ZSTD_WORKSPACE_SIZE (640 * 1024)
+
+/* Ring of pre-compressed payloads, sized for the largest (V40) capacity */
+#define QRCON_READY_FRAMES 256
+#define QRCON_READY_FRAME_SIZE 3072
+/* Frames compressed per work run before yielding */
+#define QRCON_PRECOMPRESS_BATCH 16
+
+/* Codes in a Structured Append series, the most the standard allows */
+#define QRCON_APPEND_MAX 16
+
+/* Colour mode */
+#define QRCON_COLOR_PLANES 3
+#define QRCON_QR_IMAGE_SIZE 4071 /* V40 image, see qr_generate() */
+
+/* Tiled mode */
+#define QRCON_MAX_TILES 16
+#define QRCON_TILE_QUIET 4  /* Light modules between codes, as ISO 18004 asks for */
+
+/* Record transform */
+#define QRCON_RECORD_RAW 0xff   /* Level column value of a line kept verbatim */
+#define QRCON_RECORD_BUF_SIZE (2 * QRCON_FILL_WINDOW_RATIO * QRCON_READY_FRAME_SIZE)
+#define QRCON_SEQ_ANCHORS 1024
+
+/* What a line of packed records holds, see qrcon_records_pack() */
+#define QRCON_REF_TEXT   0          /* Text, in the text column */
+#define QRCON_REF_TRACE  1          /* Call trace frame, see qrcon_trace_put() */
+#define QRCON_REF_FORMAT 2          /* + printk index ID, see qrcon_pi_put_args() */
+
+/* Call trace frames */
+#define QRCON_TRACE_MAX_INDENT 15
+#define QRCON_SYM_CACHE_BITS 8
+
+/* printk index references, see qrcon_pi_lookup() */
+#define QRCON_PI_MAX_ENTRIES 65536
+#define QRCON_PI_HASH_BITS 12
+#define QRCON_PI_KEY_LEN 8          /* Literal bytes a format is looked up by */
+#define QRCON_PI_SCAN_LEN 64        /* Extent of a "driver device: " style prefix */
+#define QRCON_PI_FMT_MAX 512
+#define QRCON_PI_MAX_ARGS 16
+#define QRCON_PI_MATCH_BUDGET 64    /* Attempts at placing conversions per format */
+
+/* How a conversion's output is sent */
+#define QRCON_PI_ARG_TEXT 0         /* Verbatim */
+#define QRCON_PI_ARG_DEC  1         /* %d, %i: zigzag varint if canonical */
+#define QRCON_PI_ARG_UDEC 2         /* %u: varint if canonical */
+#define QRCON_PI_ARG_HEX  3         /* %x: varint if canonical */
+#define QRCON_PI_ARG_HEXU 4         /* %X: varint if canonical */
+
+/* Line references kept across the fill attempts of a frame, see qrcon_line_ref() */
+#define QRCON_LINE_REFS 256
+#define QRCON_LINE_ARGS 512
+#define QRCON_LINE_FRAMES 128
 
 /* Compression level (1-8) */
-/* Anything above 8 is not supported, unless you want 55MB of static memory. */
+/* Levels above 8 need a larger QRCON_ZSTD_WORKSPACE_SIZE. */
 static int compression_level = 3;
 
+/* Compression backends, selected with compression_codec */
+#define QRCON_COMPRESS_ZSTD  0
+#define QRCON_COMPRESS_LZ4   1  /* Fastest, lowest ratio */
+#define QRCON_COMPRESS_LZ4HC 2
+#define QRCON_COMPRESS_BEST  3  /* zstd and LZ4HC per frame, keep whichever fits more */
+static int compression_codec = QRCON_COMPRESS_ZSTD;
+static int lz4hc_level = LZ4HC_DEFAULT_CLEVEL;
+
 // Ensure SPMI/SDAM/NVMEM is properly configured for this to work.
 static int reboot_to_bootloader = 0;
 
+/* Draw through drm_panic when a DRM device supports it, before trying fb0 */
+static int drm_backend = 1;
+
+/* Until a driver registers fb0, draw on the framebuffer set up by the firmware */
+static int firmware_fb = 1;
+
+#ifdef QRCON_FBDEV
 /* Add extern declaration for registered_fb */
 extern struct fb_info *registered_fb[FB_MAX];
+#endif
 
-/* Framebuffer globals */
+/* Framebuffer globals, also set up for DRM scanout buffers, with fb_info NULL */
 static struct fb_info *fb_info;
 static u8 *fb_screen_base;
+static u8 *fb_draw_base;  /* Where frames are drawn, see qrcon_setup_pages() */
+static int fb_back_page;  /* Page drawn next when flipping pages, -1 to draw on screen */
 static u32 fb_screen_size;
 static u32 bytes_per_pixel;
 static u32 line_length;
 static u32 xres, yres;
+/* Version picked for the framebuffer in auto mode, 0 until one was seen */
+static int qr_auto_version;
+
+#ifdef QRCON_DRM_PANIC
+#define QRCON_DRM_CARDS 4   /* /dev/dri/card0 to card3 are tried */
+#define QRCON_DRM_PROBE_MAX (64 * HZ) /* Longest wait between two looks */
+
+/* Device found by qrcon_find_drm(), and the plane drawn on at panic */
+static struct drm_device *drm_dev;
+static struct drm_plane *drm_plane;
+static unsigned long drm_lock_flags;
+static struct fb_var_screeninfo drm_var; /* Scanout buffer, described the fbdev way */
+static unsigned long drm_probe_delay = HZ; /* Doubles after every look */
+static unsigned long drm_probe_next;       /* Jiffies of the next look */
+#endif
+
+#ifdef QRCON_FIRMWARE_FB
+/* Firmware framebuffer, mapped at init by qrcon_map_firmware_fb() */
+static u8 *fw_fb_map;
+static bool fw_fb_ram;     /* Mapped with memremap(), the memory is RAM */
+static u32 fw_fb_line_length;
+static struct fb_var_screeninfo fw_fb_var;
+static bool fw_fb_retired; /* A driver took over the display, the memory may be reused */
+#endif
+
+/* Grid of codes in tiled mode, see qrcon_tile_layout() */
+struct qrcon_tile_layout {
+    int count;  /* Codes per screen */
+    int cols;
+    int block;  /* Module size in pixels */
+    int pitch;  /* Distance between two codes */
+    int x, y;   /* Top left corner of the first code */
+};
+
+static int tile_next; /* Tile the next code is drawn in */
+static u16 tile_seq;  /* Number of the next frame shown in tiled mode */
+static u16 stream_id; /* Random per boot, see qrcon_stream_header */
+
+/* Codes waiting to be drawn together in colour mode, dark modules clear the
+ * framebuffer bits of their channel in color_masks.
+ */
+static u8 color_planes[QRCON_COLOR_PLANES][QRCON_QR_IMAGE_SIZE];
+static u32 color_masks[QRCON_COLOR_PLANES];
+static int color_next; /* Plane the next code goes to */
+
+/* Cached copy of one framebuffer row, filled once and copied down to the
+ * rows below, which is much cheaper than pixel by pixel writes to
+ * uncached framebuffer memory. Wider screens are drawn in pieces.
+ */
+#define QRCON_SCANLINE_PIXELS 4096
+static u8 qr_scanline[QRCON_SCANLINE_PIXELS * 4];
+static u32 qr_row_colors[177]; /* Colour of each module of a V40 row */
+static u8 qr_row_changed[23];  /* Modules of the row that differ from the code on screen */
+
+/* Images on screen, one per tile and page, so the next code only repaints
+ * the rows of modules that changed. Sized at init for the tiles and colour
+ * planes the knobs allow. A width of 0 means nothing known, and without
+ * them every code is drawn in full.
+ */
+static u8 *shown_planes;
+static u8 shown_width[2 * QRCON_MAX_TILES];
+static int shown_tiles;   /* Slots per page */
+static int shown_nplanes; /* Images per slot */
 
 /* QR code buffers */
 /* Buffer holds compressed payload before qr_generate, overwritten with QR image after */
@@ -83,74 +369,766 @@ static u8 qr_tmp_workspace[QR_TMP_WORKSPACE_SIZE];
 static size_t qr_payload_len;
 static u8 qr_width;
 
-/* Compression context and static workspace */
+/* Compression context and static workspace, shared with the dictionary */
 static ZSTD_CCtx *cctx;
+static const ZSTD_CDict *cdict;
+static ZSTD_compressionParameters zstd_cparams; /* Per-frame compression */
+static ZSTD_compressionParameters zstd_stream_cparams; /* Stream mode */
 static u8 zstd_static_workspace[QRCON_ZSTD_WORKSPACE_SIZE];
 
+/* LZ4 and LZ4HC state, never used at the same time */
+#define QRCON_LZ4_WORKSPACE_SIZE \
+    (LZ4HC_MEM_COMPRESS > LZ4_MEM_COMPRESS ? LZ4HC_MEM_COMPRESS : LZ4_MEM_COMPRESS)
+static u8 lz4_workspace[QRCON_LZ4_WORKSPACE_SIZE] __aligned(8);
+/* Output of the second codec in QRCON_COMPRESS_BEST mode */
+static u8 qrcon_codec_scratch[QR_PAYLOAD_AND_IMAGE_BUF_SIZE];
+
+/* A compression backend. fill() compresses the longest prefix of src that
+ * fits payload_cap bytes into dst (dst_size bytes may be used as scratch).
+ * Return: compressed size, 0 if nothing fits; *processed is the prefix length.
+ */
+struct qrcon_codec {
+    const char *name;
+    u8 id;  /* QRCON_CODEC_* in the frame header */
+    size_t (*fill)(const u8 *src, size_t src_size, u8 *dst, size_t dst_size,
+                   size_t payload_cap, size_t *processed_size);
+    /* Single shot, as in qrcon_compress_fn */
+    size_t (*compress)(const u8 *src, size_t src_size, u8 *dst, size_t dst_size);
+};
+
 /* kmsg history data */
 static bool qrcon_initialized = false;
 static u8 kmsg_history_buf[KMSG_HISTORY_BUF_SIZE];
 static size_t kmsg_history_len = 0;
 static size_t kmsg_history_pos = 0;
 
+/* printk sequence numbers of the history. Lines follow each other one
+ * sequence number apart, except where an anchor says otherwise: at the
+ * first line, after dropped records, and on the extra lines of a
+ * multi-line record (which share its number). When the anchors run out,
+ * the oldest history is discarded along with them, see qrcon_history_append().
+ */
+struct qrcon_seq_anchor {
+    size_t off;     /* Start of a line in kmsg_history_buf */
+    u64 seq;
+};
+static struct qrcon_seq_anchor seq_anchors[QRCON_SEQ_ANCHORS];
+static unsigned int seq_anchor_count;
+static u64 history_next_seq; /* Sequence number expected for the next record */
+/* Last lookup, frames are packed in order. An offset of SIZE_MAX means none */
+static struct qrcon_seq_anchor seq_cursor = { .off = SIZE_MAX };
+
+/* Output of one conversion, within the text of a record */
+struct qrcon_pi_arg {
+    u32 off;
+    u32 len;
+    u8 type;
+};
+
+#ifdef QRCON_PRINTK_INDEX
+/* Bounds of the .printk_index section of vmlinux */
+extern struct pi_entry *__start_printk_index[];
+extern struct pi_entry *__stop_printk_index[];
+
+/* Index entries by ID, chained by the first literal bytes of their format */
+struct qrcon_pi_slot {
+    u32 pos;    /* Position in the .printk_index section */
+    u32 next;   /* ID + 1 of the next entry in the hash chain, 0 at the end */
+};
+static struct qrcon_pi_slot *pi_slots; /* Allocated for the entries found */
+static u32 pi_hash[1 << QRCON_PI_HASH_BITS];
+static char pi_fmt_buf[QRCON_PI_FMT_MAX];
+#endif
+/* Entries listed in debugfs printk/index/vmlinux, whose order gives the IDs */
+static u32 pi_count;
+
+/* Call trace frame "<indent>[? ]symbol+0xoffset/0xsize<tail>", see qrcon_trace_parse() */
+struct qrcon_trace_frame {
+    u32 indent;
+    bool unreliable;        /* "? " */
+    unsigned long addr;     /* symbol + offset, relative to _text */
+    unsigned long size;
+    u8 hash;                /* Of the symbol name, tells aliases apart */
+    u32 tail_off;           /* Text after the size, within the line */
+    u32 tail_len;
+};
+
+/* What the complete lines from a frame start are sent as. Every fill
+ * attempt of a frame packs the same lines again, twice, so they are only
+ * looked up once. Conversion outputs and trace frames are kept in pools.
+ */
+struct qrcon_line_ref {
+    u32 ref;
+    u16 first;  /* First conversion in line_args, or the frame in line_frames */
+    u8 nargs;
+};
+static struct qrcon_line_ref line_refs[QRCON_LINE_REFS];
+static struct qrcon_pi_arg line_args[QRCON_LINE_ARGS];
+static struct qrcon_trace_frame line_frames[QRCON_LINE_FRAMES];
+static unsigned int line_refs_count;
+static unsigned int line_args_count;
+static unsigned int line_frames_count;
+static size_t line_refs_off = SIZE_MAX; /* History offset of the frame start, SIZE_MAX if none */
+
+#ifdef QRCON_TRACE_SYMBOLS
+/* kallsyms_lookup_name() scans the whole symbol table, so remember its results */
+struct qrcon_sym_cache_entry {
+    u32 hash;               /* jhash of the name */
+    bool valid;
+    unsigned long addr;     /* 0 if not found */
+};
+static struct qrcon_sym_cache_entry qrcon_sym_cache[1 << QRCON_SYM_CACHE_BITS];
+static char qrcon_sym_name[KSYM_NAME_LEN];
+static char qrcon_sym_buf[KSYM_SYMBOL_LEN];
+#endif
+
+/* Column-packed records of the frame being compressed */
+static u8 qrcon_record_buf[QRCON_RECORD_BUF_SIZE];
+static size_t qrcon_record_len;
+static const struct qrcon_codec *qrcon_record_codec;
+
+/* Pre-compressed payload covering kmsg_history_buf[src_off, src_off + src_len) */
+struct qrcon_ready_frame {
+    size_t src_off;
+    size_t src_len;
+    size_t len;
+    u8 payload[QRCON_READY_FRAME_SIZE];
+};
+
+/* Ready frames ring, oldest at ready_head, contiguous in history order */
+static struct qrcon_ready_frame ready_frames[QRCON_READY_FRAMES];
+static unsigned int ready_head;
+static unsigned int ready_count;
+static size_t ready_capacity; /* Target capacity the ring was built for */
+static size_t precompress_pos; /* History offset up to which frames are ready */
+static bool precompress_busy = false; /* Set while the work item uses cctx */
+
+/* Payloads of the Structured Append series being collected. The parity
+ * covers every code, so none can be drawn before the last one is known.
+ */
+static u8 append_payloads[QRCON_APPEND_MAX][QRCON_READY_FRAME_SIZE];
+static size_t append_lens[QRCON_APPEND_MAX];
+static unsigned int append_count;
+
+/* Runtime capture state */
+static struct workqueue_struct *qrcon_wq;
+static struct delayed_work capture_work;
+static struct kmsg_dump_iter capture_iter;
+static char capture_line_buf[QR_PAYLOAD_AND_IMAGE_BUF_SIZE];
+static u64 capture_next_seq; /* First printk sequence not yet in the history buffer */
+static bool capture_started = false;
+static bool capture_busy = false; /* Set while the work item modifies the history buffer */
+
 /* Panic notification handling */
 static bool panic_in_progress = false;
 static bool panic_rendering_complete = false;
 
 /* Function prototypes */
-static int qrcon_render_qr(void);
+static int qrcon_render_qr(const struct qr_structured_append *append);
 
-/* Helper: Write a pixel's color into memory */
-static inline void write_color_to_ptr(u8 *ptr, u32 color, u32 bpp)
+/* Helper: Fill @n pixels at @ptr with @color, one loop per pixel size */
+static void qrcon_fill_pixels(u8 *ptr, u32 color, int n)
 {
-    switch (bpp) {
+    int i;
+
+    switch (bytes_per_pixel) {
     case 4:
-        *(u32 *)ptr = color;
+        memset32((u32 *)ptr, color, n);
         break;
     case 3:
-        ptr[0] = color & 0xFF;
-        ptr[1] = (color >> 8) & 0xFF;
-        ptr[2] = (color >> 16) & 0xFF;
+        for (i = 0; i < n; i++, ptr += 3) {
+            ptr[0] = color & 0xFF;
+            ptr[1] = (color >> 8) & 0xFF;
+            ptr[2] = (color >> 16) & 0xFF;
+        }
         break;
     case 2:
-        *(u16 *)ptr = color;
+        memset16((u16 *)ptr, color, n);
         break;
     case 1:
-        *ptr = color;
+        memset(ptr, color, n);
         break;
     default:
         break;
     }
 }
 
+/* Copy the first @n pixels of qr_scanline to framebuffer rows @y to @max_y - 1 at @x */
+static void qrcon_copy_scanline(int x, int y, int max_y, int n)
+{
+    u8 *row = fb_draw_base + y * line_length + x * bytes_per_pixel;
+
+    for (; y < max_y; y++, row += line_length)
+        memcpy(row, qr_scanline, n * bytes_per_pixel);
+}
+
 /* Draw rectangle on framebuffer */
 static int qrcon_draw_rect(int x, int y, int width, int height, u32 color)
 {
-    int i, current_width;
-    int max_y;
-    u8 *row;
-    int j;
-    
+    int max_x, max_y, n;
+
     if (!fb_screen_base)
         return -EINVAL;
-    max_y = (y + height > yres) ? yres : y + height;
-    for (i = y; i < max_y; i++) {
-        current_width = (x + width > xres) ? (xres - x) : width;
-        if (current_width <= 0)
+    /* The border around a code that fills the screen starts off screen */
+    if (x < 0) {
+        width += x;
+        x = 0;
+    }
+    if (y < 0) {
+        height += y;
+        y = 0;
+    }
+    max_x = min_t(int, x + width, xres);
+    max_y = min_t(int, y + height, yres);
+    if (x >= max_x || y >= max_y)
+        return 0;
+
+    /* One row is filled in the cached scanline, then copied down */
+    n = min(max_x - x, QRCON_SCANLINE_PIXELS);
+    qrcon_fill_pixels(qr_scanline, color, n);
+    for (; x < max_x; x += n)
+        qrcon_copy_scanline(x, y, max_y, min(n, max_x - x));
+    return 0;
+}
+
+/* Expand framebuffer pixels @from to @to - 1 of a row of modules into
+ * qr_scanline: @colors of @width modules @block pixels wide from @code_x,
+ * @white on either side. Runs of modules of one colour are filled at once.
+ */
+static void qrcon_expand_row(const u32 *colors, int width, int code_x, int block,
+                             u32 white, int from, int to)
+{
+    int x = from, end, m;
+    u32 color;
+
+    while (x < to) {
+        if (x < code_x) {
+            end = code_x;
+            color = white;
+        } else if (x >= code_x + width * block) {
+            end = to;
+            color = white;
+        } else {
+            m = (x - code_x) / block;
+            color = colors[m];
+            while (m + 1 < width && colors[m + 1] == color)
+                m++;
+            end = code_x + (m + 1) * block;
+        }
+        end = min(end, to);
+        qrcon_fill_pixels(qr_scanline + (x - from) * bytes_per_pixel, color, end - x);
+        x = end;
+    }
+}
+
+/* Largest QR version whose modules, drawn the way qrcon_render_qr() does,
+ * are at least qr_min_module_px pixels and qr_min_module_um micrometres.
+ * The physical size is only checked if the panel reports it in var.width
+ * and var.height, which many simple framebuffers leave at 0 or -1.
+ */
+static int qrcon_auto_version(const struct fb_var_screeninfo *var)
+{
+    u32 side = min(var->xres, var->yres) * qr_size_percent / 100;
+    u32 um_per_px = 0;
+    u32 block;
+    int version;
+
+    if (var->width && var->width != ~0U && var->xres)
+        um_per_px = var->width * 1000 / var->xres;
+    else if (var->height && var->height != ~0U && var->yres)
+        um_per_px = var->height * 1000 / var->yres;
+
+    for (version = 40; version > 1; version--) {
+        block = side / (version * 4 + 17);
+        if (block >= qr_min_module_px && (!um_per_px || block * um_per_px >= qr_min_module_um))
+            break;
+    }
+    return version;
+}
+
+/* In auto mode, pick the version for @info. A change drops the ready
+ * frames, as qrcon_precompress() and the panic path see a new capacity.
+ */
+static void qrcon_update_auto_version(const struct fb_var_screeninfo *var)
+{
+    int version;
+
+    if (qr_version != QR_VERSION_AUTO)
+        return;
+    version = qrcon_auto_version(var);
+    if (version == qr_auto_version)
+        return;
+    pr_info("qrcon: Auto QR version %d for %ux%u pixels, %ux%u mm\n",
+            version, var->xres, var->yres, var->width, var->height);
+    WRITE_ONCE(qr_auto_version, version);
+}
+
+/* QR version in use, 0 in auto mode until a framebuffer was seen */
+static int qrcon_qr_version(void)
+{
+    if (qr_version == QR_VERSION_AUTO)
+        return READ_ONCE(qr_auto_version);
+    return qr_version;
+}
+
+/* Channel bits of the framebuffer, for colour mode */
+static void qrcon_update_color_masks(const struct fb_var_screeninfo *var)
+{
+    const struct fb_bitfield *channels[QRCON_COLOR_PLANES] = { &var->red, &var->green, &var->blue };
+    int i;
+
+    for (i = 0; i < QRCON_COLOR_PLANES; i++) {
+        color_masks[i] = 0;
+        if (var->bits_per_pixel >= 16 && channels[i]->length)
+            color_masks[i] = ((1U << channels[i]->length) - 1) << channels[i]->offset;
+    }
+    if (qr_color && (!color_masks[0] || !color_masks[1] || !color_masks[2]))
+        pr_warn("qrcon: No RGB channels at %d bpp, drawing one code per frame\n",
+                var->bits_per_pixel);
+}
+
+/* Colour of light modules: every channel on, or all bits if unknown */
+static u32 qrcon_white(void)
+{
+    u32 white = color_masks[0] | color_masks[1] | color_masks[2];
+
+    return white ? white : 0x00FFFFFF;
+}
+
+/* Whether codes are drawn three at a time, see qr_color */
+static bool qrcon_color_mode(void)
+{
+    return qr_color && color_masks[0] && color_masks[1] && color_masks[2];
+}
+
+/* Draw frames offscreen when the framebuffer holds two pages and can pan
+ * between them, see qrcon_present(). The page not on screen starts as a copy
+ * of the one that is, so the console around the codes stays put.
+ */
+static void qrcon_setup_pages(void)
+{
+    const struct fb_var_screeninfo *var;
+    size_t page_size = (size_t)yres * line_length;
+
+    fb_draw_base = fb_screen_base;
+    fb_back_page = -1;
+    /* DRM scanout buffers are drawn in place */
+    if (!fb_info || !fb_info->fbops || !fb_info->fbops->fb_pan_display || !fb_info->fix.ypanstep)
+        return;
+    var = &fb_info->var;
+    if (var->yres_virtual < 2 * yres || fb_screen_size < 2 * page_size)
+        return;
+    if (var->yoffset != 0 && var->yoffset != yres)
+        return;
+
+    fb_back_page = var->yoffset ? 0 : 1;
+    fb_draw_base = fb_screen_base + fb_back_page * page_size;
+    memcpy(fb_draw_base, fb_screen_base + var->yoffset * line_length, page_size);
+    pr_info("qrcon: Drawing offscreen, flipping between two pages\n");
+}
+
+#ifdef QRCON_DRM_PANIC
+/* Find a DRM device whose planes support drm_panic. Device nodes are the
+ * only way in from outside the DRM core, and opening one is not free: with
+ * no DRM master yet, the file briefly becomes master, so a compositor's
+ * SET_MASTER can fail with EBUSY until it is closed, which also restores
+ * the fbdev client. Drivers such as amdgpu and nouveau wake the GPU from
+ * runtime suspend for the open. A reference to the device is kept, so the
+ * node is closed again right away.
+ *
+ * Called from the capture work, once /dev is up. Looks are spaced out
+ * further each time, up to QRCON_DRM_PROBE_MAX, and stop while a device is
+ * known or fb0 is registered. A device that goes away, such as simpledrm
+ * handing over to the GPU's driver, is dropped and the search starts over.
+ */
+static void qrcon_find_drm(void)
+{
+    char path[] = "/dev/dri/card0";
+    struct drm_device *dev = drm_dev;
+    struct drm_plane *plane;
+    struct drm_file *priv;
+    struct file *file;
+    int i;
+
+    if (dev && drm_dev_is_unplugged(dev)) {
+        pr_info("qrcon: %s was unplugged, looking for another DRM device\n", dev->driver->name);
+        WRITE_ONCE(drm_dev, NULL);
+        drm_dev_put(dev);
+        drm_probe_delay = HZ;
+        drm_probe_next = jiffies;
+    }
+    if (drm_dev || !drm_backend || time_before(jiffies, drm_probe_next))
+        return;
+#ifdef QRCON_FBDEV
+    /* fb0 is drawn on then, no need to disturb DRM devices */
+    if (READ_ONCE(registered_fb[0]))
+        return;
+#endif
+    drm_probe_next = jiffies + drm_probe_delay;
+    drm_probe_delay = min_t(unsigned long, 2 * drm_probe_delay, QRCON_DRM_PROBE_MAX);
+
+    for (i = 0; i < QRCON_DRM_CARDS && !drm_dev; i++) {
+        path[sizeof(path) - 2] = '0' + i;
+        file = filp_open(path, O_RDONLY, 0);
+        if (IS_ERR(file))
+            continue;
+        if (imajor(file_inode(file)) == DRM_MAJOR) {
+#ifdef QRCON_FIRMWARE_FB
+            /* Whatever the driver, it may have taken over the firmware's memory */
+            WRITE_ONCE(fw_fb_retired, true);
+#endif
+            priv = file->private_data;
+            drm_for_each_plane(plane, priv->minor->dev) {
+                if (plane->helper_private && plane->helper_private->get_scanout_buffer) {
+                    drm_dev = priv->minor->dev;
+                    drm_dev_get(drm_dev);
+                    pr_info("qrcon: Using %s (%s) through drm_panic\n", path, drm_dev->driver->name);
+                    break;
+                }
+            }
+        }
+        filp_close(file, NULL);
+    }
+}
+
+/* Describe a scanout buffer format the fbdev way, for the drawing code.
+ * Return: false for formats qrcon cannot draw, such as YUV or 8 bpp.
+ */
+static bool qrcon_drm_format(const struct drm_format_info *format, struct fb_var_screeninfo *var)
+{
+    u32 r = 16, g = 8, b = 0, len = 8;
+
+    switch (format->format) {
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_RGB888:
+        break;
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_BGR888:
+        r = 0;
+        b = 16;
+        break;
+    case DRM_FORMAT_XRGB2101010:
+    case DRM_FORMAT_ARGB2101010:
+        r = 20;
+        g = 10;
+        len = 10;
+        break;
+    case DRM_FORMAT_XBGR2101010:
+    case DRM_FORMAT_ABGR2101010:
+        r = 0;
+        g = 10;
+        b = 20;
+        len = 10;
+        break;
+    case DRM_FORMAT_RGB565:
+        r = 11;
+        g = 5;
+        len = 5;
+        break;
+    case DRM_FORMAT_BGR565:
+        r = 0;
+        g = 5;
+        b = 11;
+        len = 5;
+        break;
+    default:
+        return false;
+    }
+
+    var->bits_per_pixel = format->cpp[0] * 8;
+    var->red.offset = r;
+    var->red.length = len;
+    var->green.offset = g;
+    var->green.length = len == 5 ? 6 : len;
+    var->blue.offset = b;
+    var->blue.length = len;
+    return true;
+}
+
+/* Take the scanout buffer of the first plane drm_panic could draw on. The
+ * panic lock is held until qrcon_close_fb(), like drm_panic does while
+ * drawing its own screen, which comes after ours.
+ */
+static int qrcon_open_drm(void)
+{
+    struct drm_scanout_buffer sb;
+    struct drm_plane *plane;
+
+    if (!drm_dev || drm_dev_is_unplugged(drm_dev))
+        return -ENODEV;
+
+    drm_for_each_plane(plane, drm_dev) {
+        if (!plane->helper_private || !plane->helper_private->get_scanout_buffer)
+            continue;
+        if (!drm_panic_trylock(drm_dev, drm_lock_flags))
+            return -EBUSY;
+
+        memset(&sb, 0, sizeof(sb));
+        /* Only linear buffers qrcon can write to directly */
+        if (plane->helper_private->get_scanout_buffer(plane, &sb) ||
+            iosys_map_is_null(&sb.map[0]) ||
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+            sb.set_pixel ||
+#endif
+            !qrcon_drm_format(sb.format, &drm_var)) {
+            drm_panic_unlock(drm_dev, drm_lock_flags);
             continue;
-        row = fb_screen_base + i * line_length + x * bytes_per_pixel;
-        for (j = 0; j < current_width; j++) {
-            write_color_to_ptr(row + j * bytes_per_pixel, color, bytes_per_pixel);
         }
+
+        drm_plane = plane;
+        fb_info = NULL;
+        fb_screen_base = sb.map[0].is_iomem ? (u8 __force *)sb.map[0].vaddr_iomem : sb.map[0].vaddr;
+        line_length = sb.pitch[0];
+        fb_screen_size = line_length * sb.height;
+        bytes_per_pixel = sb.format->cpp[0];
+        xres = drm_var.xres = sb.width;
+        yres = drm_var.yres = sb.height;
+        pr_info("qrcon: DRM scanout buffer opened: %dx%d, %p4cc\n", xres, yres, &sb.format->format);
+        qrcon_update_auto_version(&drm_var);
+        qrcon_update_color_masks(&drm_var);
+        qrcon_setup_pages();
+        return 0;
+    }
+    return -ENODEV;
+}
+#endif
+
+#ifdef QRCON_FIRMWARE_FB
+#ifdef QRCON_SCREEN_INFO
+/* Describe the EFI GOP or VESA framebuffer the boot loader left in screen_info */
+static bool qrcon_screen_info_fb(phys_addr_t *base)
+{
+    const struct screen_info *si = &screen_info;
+
+    if (si->orig_video_isVGA != VIDEO_TYPE_EFI && si->orig_video_isVGA != VIDEO_TYPE_VLFB)
+        return false;
+
+    *base = si->lfb_base;
+    if (si->capabilities & VIDEO_CAPABILITY_64BIT_BASE)
+        *base |= (u64)si->ext_lfb_base << 32;
+    fw_fb_line_length = si->lfb_linelength;
+    fw_fb_var.xres = si->lfb_width;
+    fw_fb_var.yres = si->lfb_height;
+    fw_fb_var.bits_per_pixel = si->lfb_depth;
+    fw_fb_var.red.offset = si->red_pos;
+    fw_fb_var.red.length = si->red_size;
+    fw_fb_var.green.offset = si->green_pos;
+    fw_fb_var.green.length = si->green_size;
+    fw_fb_var.blue.offset = si->blue_pos;
+    fw_fb_var.blue.length = si->blue_size;
+    return *base != 0;
+}
+#endif
+
+#ifdef QRCON_SIMPLE_FB
+/* Parse a simple-framebuffer format such as "a8r8g8b8" or "r5g6b5", which
+ * lists the channels from the most significant bit down.
+ * Return: false for formats that are not 16, 24 or 32 bpp RGB.
+ */
+static bool qrcon_parse_fb_format(const char *format, struct fb_var_screeninfo *var)
+{
+    struct fb_bitfield *field;
+    const char *p;
+    char *end;
+    u32 bits = 0;
+    u32 len;
+
+    for (p = format; *p; p = end) {
+        if (!strchr("rgbax", *p))
+            return false;
+        len = simple_strtoul(p + 1, &end, 10);
+        if (!len || len > 16)
+            return false;
+        bits += len;
+    }
+    if (bits != 16 && bits != 24 && bits != 32)
+        return false;
+
+    var->bits_per_pixel = bits;
+    var->red.length = var->green.length = var->blue.length = 0;
+    for (p = format; *p; p = end) {
+        len = simple_strtoul(p + 1, &end, 10);
+        bits -= len;
+        field = *p == 'r' ? &var->red : *p == 'g' ? &var->green : *p == 'b' ? &var->blue : NULL;
+        if (field) {
+            field->offset = bits;
+            field->length = len;
+        }
+    }
+    return var->red.length && var->green.length && var->blue.length;
+}
+
+/* Describe the first enabled simple-framebuffer node of the device tree.
+ * A framebuffer in a reserved memory region is RAM, and has @ram set.
+ */
+static bool qrcon_simple_fb(phys_addr_t *base, bool *ram)
+{
+    struct device_node *np, *mem;
+    struct resource res;
+    const char *format;
+    bool found = false;
+    int ret;
+
+    for_each_compatible_node(np, NULL, "simple-framebuffer") {
+        if (!of_device_is_available(np))
+            continue;
+        if (of_property_read_u32(np, "width", &fw_fb_var.xres) ||
+            of_property_read_u32(np, "height", &fw_fb_var.yres) ||
+            of_property_read_u32(np, "stride", &fw_fb_line_length) ||
+            of_property_read_string(np, "format", &format) ||
+            !qrcon_parse_fb_format(format, &fw_fb_var))
+            continue;
+
+        /* The memory is either the node's own reg or a reserved region */
+        mem = of_parse_phandle(np, "memory-region", 0);
+        ret = of_address_to_resource(mem ? mem : np, 0, &res);
+        of_node_put(mem);
+        if (ret)
+            continue;
+
+        *base = res.start;
+        *ram = mem != NULL;
+        found = true;
+        of_node_put(np);
+        break;
+    }
+    return found;
+}
+#endif
+
+/* Platform devices that stand for the firmware framebuffer. Drivers for
+ * the real hardware remove them before they take over its memory, see
+ * aperture_remove_conflicting_devices().
+ */
+static bool qrcon_firmware_fb_device(struct device *dev)
+{
+    static const char * const names[] = {
+        "simple-framebuffer", "efi-framebuffer", "vesa-framebuffer", "vga-framebuffer",
+    };
+    const char *name = to_platform_device(dev)->name;
+    int i;
+
+#ifdef QRCON_SIMPLE_FB
+    if (of_device_is_compatible(dev->of_node, "simple-framebuffer"))
+        return true;
+#endif
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        if (name && !strcmp(name, names[i]))
+            return true;
     }
+    return false;
+}
+
+/* Retire the firmware framebuffer as its device goes, before the memory
+ * changes hands, rather than when the capture work next runs
+ */
+static int qrcon_platform_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+    if (action == BUS_NOTIFY_DEL_DEVICE && !fw_fb_retired && qrcon_firmware_fb_device(data)) {
+        WRITE_ONCE(fw_fb_retired, true);
+        pr_info("qrcon: %s removed, firmware framebuffer retired\n", dev_name(data));
+    }
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block qrcon_platform_nb = {
+    .notifier_call = qrcon_platform_notify,
+};
+
+/* Map the firmware framebuffer while mapping is still allowed, so a panic
+ * before simplefb, efifb or a DRM driver probes still has a screen. Only
+ * called at init, the panic path cannot ioremap. Reserved RAM is mapped
+ * like simpledrm does, ioremap() refuses RAM on some architectures.
+ */
+static void qrcon_map_firmware_fb(void)
+{
+    phys_addr_t base = 0;
+    bool found = false;
+    size_t size;
+
+    if (!firmware_fb)
+        return;
+#ifdef QRCON_SIMPLE_FB
+    found = qrcon_simple_fb(&base, &fw_fb_ram);
+#endif
+#ifdef QRCON_SCREEN_INFO
+    if (!found)
+        found = qrcon_screen_info_fb(&base);
+#endif
+    if (!found || !fw_fb_var.xres || !fw_fb_var.yres || fw_fb_var.bits_per_pixel < 16 ||
+        fw_fb_line_length < fw_fb_var.xres * (fw_fb_var.bits_per_pixel / 8))
+        return;
+
+    size = (size_t)fw_fb_line_length * fw_fb_var.yres;
+    if (fw_fb_ram)
+        fw_fb_map = memremap(base, size, MEMREMAP_WC);
+    else
+        fw_fb_map = (u8 __force *)ioremap_wc(base, size);
+    if (!fw_fb_map) {
+        pr_warn("qrcon: Failed to map firmware framebuffer at %pa\n", &base);
+        return;
+    }
+    bus_register_notifier(&platform_bus_type, &qrcon_platform_nb);
+    pr_info("qrcon: Firmware framebuffer at %pa: %ux%u, %u bpp\n",
+            &base, fw_fb_var.xres, fw_fb_var.yres, fw_fb_var.bits_per_pixel);
+    qrcon_update_auto_version(&fw_fb_var);
+}
+
+/* Undo qrcon_map_firmware_fb() */
+static void qrcon_unmap_firmware_fb(void)
+{
+    if (!fw_fb_map)
+        return;
+    bus_unregister_notifier(&platform_bus_type, &qrcon_platform_nb);
+    if (fw_fb_ram)
+        memunmap(fw_fb_map);
+    else
+        iounmap((void __iomem __force *)fw_fb_map);
+}
+
+/* Draw on the firmware framebuffer, if no driver has taken it over yet.
+ * Drivers that did not remove a firmware framebuffer device are only
+ * noticed by the capture work, so it must be running.
+ */
+static int qrcon_open_firmware_fb(void)
+{
+    if (!fw_fb_map || READ_ONCE(fw_fb_retired) || !capture_started)
+        return -ENODEV;
+
+    fb_info = NULL;
+    fb_screen_base = fw_fb_map;
+    line_length = fw_fb_line_length;
+    bytes_per_pixel = fw_fb_var.bits_per_pixel / 8;
+    xres = fw_fb_var.xres;
+    yres = fw_fb_var.yres;
+    fb_screen_size = line_length * yres;
+    pr_info("qrcon: Firmware framebuffer opened: %dx%d, %d bpp\n", xres, yres, fw_fb_var.bits_per_pixel);
+    qrcon_update_auto_version(&fw_fb_var);
+    qrcon_update_color_masks(&fw_fb_var);
+    qrcon_setup_pages();
     return 0;
 }
+#endif
 
-/* Open framebuffer, only fb0 is supported */
+/* Open the screen: a drm_panic scanout buffer if there is one, else fb0,
+ * else the framebuffer of the firmware
+ */
 static int qrcon_open_fb(void)
 {
+#ifdef QRCON_DRM_PANIC
+    if (drm_backend && qrcon_open_drm() == 0)
+        return 0;
+#endif
+#ifdef QRCON_FBDEV
     fb_info = registered_fb[0];
+#endif
     if (!fb_info) {
+#ifdef QRCON_FIRMWARE_FB
+        if (qrcon_open_firmware_fb() == 0)
+            return 0;
+#endif
         pr_err("qrcon: Failed to get fb_info for fb0\n");
         return -ENODEV;
     }
@@ -161,40 +1139,188 @@ static int qrcon_open_fb(void)
     xres = fb_info->var.xres;
     yres = fb_info->var.yres;
     pr_info("qrcon: Framebuffer opened: %dx%d, %d bpp\n", xres, yres, fb_info->var.bits_per_pixel);
+    qrcon_update_auto_version(&fb_info->var);
+    qrcon_update_color_masks(&fb_info->var);
+    qrcon_setup_pages();
     return 0;
 }
 
-/* Render QR code on the framebuffer */
-static int qrcon_render_qr(void)
+/* Hand the screen back once the codes are done */
+static void qrcon_close_fb(void)
+{
+#ifdef QRCON_DRM_PANIC
+    if (drm_plane) {
+        drm_panic_unlock(drm_dev, drm_lock_flags);
+        drm_plane = NULL;
+    }
+#endif
+}
+
+/* Allocate the images kept by qrcon_draw_qr(), one per tile on each page */
+static void qrcon_init_shown(void)
+{
+    shown_tiles = qr_tiles > 0 ? min(qr_tiles, QRCON_MAX_TILES) : QRCON_MAX_TILES;
+    shown_nplanes = qr_color ? QRCON_COLOR_PLANES : 1;
+    shown_planes = kvmalloc_array(2 * shown_tiles * shown_nplanes, QRCON_QR_IMAGE_SIZE,
+                                  GFP_KERNEL);
+    if (!shown_planes)
+        pr_warn("qrcon: No memory for the codes on screen, drawing them in full\n");
+}
+
+/* Slot of @tile on the page drawn next */
+static int qrcon_shown_slot(int tile)
+{
+    return tile + (fb_back_page > 0 ? shown_tiles : 0);
+}
+
+/* Image of @plane last drawn in @slot */
+static u8 *qrcon_shown_plane(int slot, int plane)
+{
+    return shown_planes + ((size_t)slot * shown_nplanes + plane) * QRCON_QR_IMAGE_SIZE;
+}
+
+/* Forget every code on screen, the next ones are drawn in full */
+static void qrcon_forget_shown(void)
+{
+    memset(shown_width, 0, sizeof(shown_width));
+}
+
+/* Show the frame drawn so far. When flipping pages, pan to it and draw the
+ * next frame on the other page, which still holds the frame before, so
+ * only whole frames are ever on screen. Otherwise let the driver flush.
+ */
+static void qrcon_present(void)
+{
+    struct fb_var_screeninfo var;
+    size_t page_size = (size_t)yres * line_length;
+
+#ifdef QRCON_DRM_PANIC
+    /* Some DRM drivers copy or blit the buffer to the display on flush */
+    if (drm_plane) {
+        if (drm_plane->helper_private->panic_flush)
+            drm_plane->helper_private->panic_flush(drm_plane);
+        return;
+    }
+#endif
+    if (!fb_info || !fb_info->fbops || !fb_info->fbops->fb_pan_display)
+        return;
+
+    var = fb_info->var;
+    if (fb_back_page < 0) {
+        fb_info->fbops->fb_pan_display(&var, fb_info);
+        return;
+    }
+
+    var.yoffset = fb_back_page * yres;
+    if (fb_info->fbops->fb_pan_display(&var, fb_info)) {
+        pr_warn("qrcon: Page flip failed, drawing on screen\n");
+        fb_back_page = -1;
+        qrcon_forget_shown();
+        var = fb_info->var;
+        memcpy(fb_screen_base + var.yoffset * line_length, fb_draw_base, page_size);
+        fb_draw_base = fb_screen_base + var.yoffset * line_length;
+        fb_info->fbops->fb_pan_display(&var, fb_info);
+        return;
+    }
+    /* The op was called directly, so the fb core did not record it */
+    fb_info->var.yoffset = var.yoffset;
+    fb_back_page ^= 1;
+    fb_draw_base = fb_screen_base + fb_back_page * page_size;
+}
+
+/* Lay out codes @width modules wide in a grid over the screen, for qr_tiles
+ * codes, or as many as fit if 0. The most codes that fit with modules of
+ * qr_min_module_px pixels wins, then the largest modules that still fit
+ * that many. Each code keeps QRCON_TILE_QUIET modules of light around it.
+ *
+ * Return: true if more than one code fits, false to draw a single code.
+ */
+static bool qrcon_tile_layout(int width, struct qrcon_tile_layout *tiles)
+{
+    int max_tiles = qr_tiles > 0 ? min(qr_tiles, QRCON_MAX_TILES) : QRCON_MAX_TILES;
+    int block, pitch, quiet, cols, rows, count;
+
+    if (qr_tiles == 1)
+        return false;
+
+    tiles->count = 0;
+    for (block = max(qr_min_module_px, 1); ; block++) {
+        quiet = QRCON_TILE_QUIET * block;
+        pitch = width * block + quiet;
+        cols = ((int)xres - quiet) / pitch;
+        rows = ((int)yres - quiet) / pitch;
+        count = min(cols * rows, max_tiles);
+        /* Larger modules until fewer codes fit */
+        if (count < 2 || count < tiles->count)
+            break;
+        tiles->count = count;
+        tiles->block = block;
+        tiles->pitch = pitch;
+        tiles->cols = min(cols, count);
+    }
+    if (!tiles->count)
+        return false;
+
+    /* Center the grid, rows only as many as needed */
+    rows = DIV_ROUND_UP(tiles->count, tiles->cols);
+    quiet = QRCON_TILE_QUIET * tiles->block;
+    tiles->x = ((int)xres - tiles->cols * tiles->pitch + quiet) / 2;
+    tiles->y = ((int)yres - rows * tiles->pitch + quiet) / 2;
+    return true;
+}
+
+/* Draw framebuffer pixels @from to @to - 1 of a row of modules, coloured
+ * as in qr_row_colors, on rows @y to @max_y - 1. See qrcon_expand_row().
+ */
+static void qrcon_draw_span(int from, int to, int y, int max_y, int code_x, int block, u32 white)
+{
+    int n;
+
+    from = max(from, 0);
+    to = min_t(int, to, xres);
+    for (; from < to; from += n) {
+        n = min(to - from, QRCON_SCANLINE_PIXELS);
+        qrcon_expand_row(qr_row_colors, qr_width, code_x, block, white, from, from + n);
+        qrcon_copy_scanline(from, y, max_y, n);
+    }
+}
+
+/* Draw the QR image in qr_payload_and_image_buf on the framebuffer, or in
+ * colour mode the three images in color_planes.
+ */
+static void qrcon_draw_qr(void)
 {
     int block_size;
     int start_x, start_y;
     int max_size_pixels, qr_render_width;
-    int x, y;
-    u8 *qr_image_ptr; /* Pointer to the QR image data in the buffer */
-    u32 black = 0x00000000;
-    u32 white = 0x00FFFFFF;
-
-    if (!fb_screen_base)
-        return -EINVAL;
-    /* Check if payload length is zero (nothing compressed yet) */
-    if (qr_payload_len == 0)
-        return 0; // Nothing to encode
-
-    pr_debug("qrcon: Generating QR code from payload: %zu bytes\n", qr_payload_len);
+    int x, y, i;
+    int stride = (qr_width + 7) / 8;
+    const u8 *planes[QRCON_COLOR_PLANES] = { qr_payload_and_image_buf };
+    u32 masks[QRCON_COLOR_PLANES] = { qrcon_white() };
+    int nplanes = 1;
+    u32 white = masks[0];
+    struct qrcon_tile_layout tiles;
+    int border = qr_border;
+    int slot = 0;
+    bool diff;
+
+    if (qrcon_color_mode()) {
+        nplanes = QRCON_COLOR_PLANES;
+        for (i = 0; i < QRCON_COLOR_PLANES; i++) {
+            planes[i] = color_planes[i];
+            masks[i] = color_masks[i];
+        }
+    }
 
-    /* Generate QR code using external library.
-     * qr_generate writes the image output into qr_payload_and_image_buf,
-     * overwriting the compressed payload that was there.
-     * It uses qr_tmp_workspace as temporary scratch space.
-     */
-    qr_width = qr_generate(NULL, qr_payload_and_image_buf, qr_payload_len,
-                           (u8)qr_version,
-                           QR_PAYLOAD_AND_IMAGE_BUF_SIZE, qr_tmp_workspace,
-                           QR_TMP_WORKSPACE_SIZE);
-    if (qr_width == 0) {
-        pr_err("qrcon: qr_generate failed\n");
-        return -EINVAL;
+    /* In tiled mode, draw into the next free tile */
+    if (qrcon_tile_layout(qr_width, &tiles)) {
+        block_size = tiles.block;
+        qr_render_width = qr_width * block_size;
+        border = QRCON_TILE_QUIET * block_size;
+        start_x = tiles.x + (tile_next % tiles.cols) * tiles.pitch;
+        start_y = tiles.y + (tile_next / tiles.cols) * tiles.pitch;
+        slot = tile_next;
+        goto draw;
     }
 
     max_size_pixels = ((xres < yres) ? xres : yres) * qr_size_percent / 100;
@@ -234,79 +1360,1286 @@ static int qrcon_render_qr(void)
         start_y = (yres - qr_render_width) / 2;
     }
 
-    if (start_x < 0) start_x = 0;
-    if (start_y < 0) start_y = 0;
-    if (start_x + qr_render_width > xres)
-        start_x = xres - qr_render_width;
-    if (start_y + qr_render_width > yres)
-        start_y = yres - qr_render_width;
+    if (start_x < 0) start_x = 0;
+    if (start_y < 0) start_y = 0;
+    if (start_x + qr_render_width > xres)
+        start_x = xres - qr_render_width;
+    if (start_y + qr_render_width > yres)
+        start_y = yres - qr_render_width;
+
+draw:
+    /* Only repaint what changed since the last code in this place */
+    slot = qrcon_shown_slot(slot);
+    diff = shown_planes && shown_width[slot] == qr_width;
+
+    /* Draw white border above and below */
+    if (!diff) {
+        qrcon_draw_rect(start_x - border, start_y - border,
+                        qr_render_width + 2 * border, border, white);
+        qrcon_draw_rect(start_x - border, start_y + qr_render_width,
+                        qr_render_width + 2 * border, border, white);
+    }
+
+    /* Render QR modules from the generated images, a dark module clears
+     * the channels of its image, so a single code is drawn in black. Each
+     * row of modules is expanded once, with the border on either side, and
+     * copied to the block_size framebuffer rows it covers. Over a code of
+     * the same size, only the runs of modules that changed are.
+     */
+    for (y = 0; y < qr_width; y++) {
+        int row_y = max(start_y + y * block_size, 0);
+        int row_end = min_t(int, start_y + (y + 1) * block_size, yres);
+        int end;
+
+        if (row_y >= row_end)
+            continue;
+        memset(qr_row_changed, 0, stride);
+        for (x = 0; x < qr_width; x++) {
+            u8 bit = 0x80 >> (x % 8);
+            u32 color = white;
+
+            for (i = 0; i < nplanes; i++) {
+                if (planes[i][y * stride + x / 8] & bit)
+                    color &= ~masks[i];
+            }
+            qr_row_colors[x] = color;
+        }
+        if (!diff) {
+            qrcon_draw_span(start_x - border, start_x + qr_render_width + border,
+                            row_y, row_end, start_x, block_size, white);
+            continue;
+        }
+
+        for (i = 0; i < nplanes; i++) {
+            for (x = 0; x < stride; x++)
+                qr_row_changed[x] |= planes[i][y * stride + x] ^ qrcon_shown_plane(slot, i)[y * stride + x];
+        }
+        for (x = 0; x < qr_width; x = end) {
+            end = x + 1;
+            if (!(qr_row_changed[x / 8] & (0x80 >> (x % 8))))
+                continue;
+            while (end < qr_width && (qr_row_changed[end / 8] & (0x80 >> (end % 8))))
+                end++;
+            qrcon_draw_span(start_x + x * block_size, start_x + end * block_size,
+                            row_y, row_end, start_x, block_size, white);
+        }
+    }
+
+    if (shown_planes) {
+        for (i = 0; i < nplanes; i++)
+            memcpy(qrcon_shown_plane(slot, i), planes[i], stride * qr_width);
+        shown_width[slot] = qr_width;
+    }
+
+    pr_debug("qrcon: QR code rendered at (%d,%d), size %dx%d\n",
+            start_x, start_y, qr_render_width, qr_render_width);
+}
+
+/* Render QR code on the framebuffer */
+static int qrcon_render_qr(const struct qr_structured_append *append)
+{
+    if (!fb_screen_base)
+        return -EINVAL;
+    /* Check if payload length is zero (nothing compressed yet) */
+    if (qr_payload_len == 0)
+        return 0; // Nothing to encode
+
+    pr_debug("qrcon: Generating QR code from payload: %zu bytes\n", qr_payload_len);
+
+    /* Generate QR code using external library.
+     * qr_generate writes the image output into qr_payload_and_image_buf,
+     * overwriting the compressed payload that was there.
+     * It uses qr_tmp_workspace as temporary scratch space.
+     */
+    qr_width = qr_generate(NULL, qr_payload_and_image_buf, qr_payload_len,
+                           (u8)qrcon_qr_version(), (u8)qr_ecc, qr_mask, append,
+                           QR_PAYLOAD_AND_IMAGE_BUF_SIZE, qr_tmp_workspace,
+                           QR_TMP_WORKSPACE_SIZE);
+    if (qr_width == 0) {
+        pr_err("qrcon: qr_generate failed\n");
+        return -EINVAL;
+    }
+
+    /* In colour mode, draw once every channel has a code */
+    if (qrcon_color_mode()) {
+        memcpy(color_planes[color_next], qr_payload_and_image_buf,
+               ((qr_width + 7) / 8) * qr_width);
+        if (++color_next < QRCON_COLOR_PLANES)
+            return 0;
+        color_next = 0;
+    }
+
+    qrcon_draw_qr();
+    return 0;
+}
+
+/* Derive zstd parameters for inputs of at most @span bytes.
+ * The default tables for a level assume large inputs; one frame only ever
+ * sees a bounded prefix, so the window and tables are shrunk to match it.
+ */
+static ZSTD_compressionParameters qrcon_zstd_cparams(int level, size_t span)
+{
+    ZSTD_compressionParameters cparams;
+
+    cparams = ZSTD_getCParams(level, span, QRCON_DICT_SIZE);
+    cparams.hashLog = min_t(unsigned int, cparams.hashLog, QRCON_ZSTD_TABLE_LOG);
+    cparams.chainLog = min_t(unsigned int, cparams.chainLog, QRCON_ZSTD_TABLE_LOG);
+    return ZSTD_adjustCParams(cparams, span, QRCON_DICT_SIZE);
+}
+
+/* Initialize compression */
+static int qrcon_init_compression(void)
+{
+    size_t required_size, stream_size;
+    size_t dict_size = 0;
+    size_t capacity;
+    unsigned int window_log;
+    
+    /* Validate compression level */
+    if (compression_level < 1 || compression_level > 22) {
+        pr_err("qrcon: Invalid compression_level %d, must be between 1 and 22.\n", compression_level);
+        return -EINVAL;
+    }
+
+    if (qr_ecc < QR_ECC_L || qr_ecc > QR_ECC_H) {
+        pr_err("qrcon: Invalid qr_ecc %d, must be QR_ECC_L to QR_ECC_H.\n", qr_ecc);
+        return -EINVAL;
+    }
+
+    /* A frame never reads more than QRCON_FILL_WINDOW_RATIO times its capacity.
+     * Auto mode can end up with any version, so plan for the largest.
+     */
+    capacity = qr_max_data_size(qr_version == QR_VERSION_AUTO ? 40 : (u8)clamp(qr_version, 1, 40),
+                                (u8)qr_ecc, 0, structured_append);
+    zstd_cparams = qrcon_zstd_cparams(compression_level, capacity * QRCON_FILL_WINDOW_RATIO);
+
+    /* Single-shot frames, and the bounded stream used to estimate the fill point */
+    required_size = ZSTD_estimateCCtxSize_usingCParams(zstd_cparams);
+    stream_size = ZSTD_estimateCStreamSize_usingCParams(zstd_cparams);
+    if (stream_size > required_size)
+        required_size = stream_size;
+
+#if QRCON_DICT_ID
+    /* The dictionary lives at the start of the workspace, cctx after it */
+    dict_size = ALIGN(ZSTD_estimateCDictSize_advanced(QRCON_DICT_SIZE, zstd_cparams, ZSTD_dlm_byRef), 8);
+    if (required_size + dict_size > QRCON_ZSTD_WORKSPACE_SIZE)
+        pr_err("qrcon: Dictionary needs %zu bytes on top of %zu, increase QRCON_ZSTD_WORKSPACE_SIZE.\n",
+               dict_size, required_size);
+    else
+        cdict = ZSTD_initStaticCDict(zstd_static_workspace, dict_size,
+                                     qrcon_dict, QRCON_DICT_SIZE,
+                                     ZSTD_dlm_byRef, ZSTD_dct_auto, zstd_cparams);
+    if (!cdict) {
+        pr_err("qrcon: Failed to load dictionary %d (%d bytes), compressing without it.\n",
+               QRCON_DICT_ID, QRCON_DICT_SIZE);
+        dict_size = 0;
+    }
+#endif
+
+    /* One frame over the whole history, with the largest window that fits */
+    if (stream_mode) {
+        for (window_log = QRCON_STREAM_WINDOW_LOG_MAX; window_log > ZSTD_WINDOWLOG_MIN; window_log--) {
+            zstd_stream_cparams = qrcon_zstd_cparams(compression_level, 1U << window_log);
+            stream_size = ZSTD_estimateCStreamSize_usingCParams(zstd_stream_cparams);
+            if (stream_size + dict_size <= QRCON_ZSTD_WORKSPACE_SIZE)
+                break;
+        }
+        if (stream_size > required_size)
+            required_size = stream_size;
+        pr_info("qrcon: Stream mode window is %u KB\n", 1U << (zstd_stream_cparams.windowLog - 10));
+    }
+
+    /* Check if the required size exceeds our static buffer */
+    if (required_size + dict_size > QRCON_ZSTD_WORKSPACE_SIZE) {
+        pr_err("qrcon: ZSTD Level %d requires %zu bytes, exceeding static buffer size %d. Reduce compression_level or increase QRCON_ZSTD_WORKSPACE_SIZE.\n",
+               compression_level, required_size + dict_size, QRCON_ZSTD_WORKSPACE_SIZE);
+        return -ENOMEM;
+    }
+
+    pr_debug("qrcon: Using compression level %d, window %u, hash %u, chain %u (requires %zu bytes, dictionary %zu bytes, static buffer %d bytes).\n",
+            compression_level, zstd_cparams.windowLog, zstd_cparams.hashLog, zstd_cparams.chainLog,
+            required_size, dict_size, QRCON_ZSTD_WORKSPACE_SIZE);
+
+    cctx = ZSTD_initStaticCCtx(zstd_static_workspace + dict_size, QRCON_ZSTD_WORKSPACE_SIZE - dict_size);
+
+    if (!cctx) {
+        pr_err("qrcon: Failed to initialize static ZSTD context.\n");
+        return -ENOMEM;
+    }
+
+    if (cdict)
+        pr_info("qrcon: Using built-in dictionary %d (%d bytes)\n", QRCON_DICT_ID, QRCON_DICT_SIZE);
+
+    return 0;
+}
+
+/* Reset cctx for a new frame at @level with @cparams, referencing the
+ * dictionary if any. Explicit parameters keep the context within the
+ * workspace sized for them, whatever the input size.
+ */
+static void qrcon_zstd_begin(int level, const ZSTD_compressionParameters *cparams)
+{
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, cparams->windowLog);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_hashLog, cparams->hashLog);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_chainLog, cparams->chainLog);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_searchLog, cparams->searchLog);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_minMatch, cparams->minMatch);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_targetLength, cparams->targetLength);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_strategy, cparams->strategy);
+    if (cdict) {
+        /* The dictionary ID is carried in the frame header instead */
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_dictIDFlag, 0);
+        ZSTD_CCtx_refCDict(cctx, cdict);
+    }
+}
+
+/* Estimate how much of src fits in payload_cap bytes of zstd output.
+ * Streams the input through cctx once, flushing after each step, and returns
+ * the longest prefix whose flushed output (plus the frame epilogue) fit.
+ * Steps shrink as the output approaches the capacity, so this reads roughly
+ * one frame worth of input. Flushed blocks carry some overhead compared to a
+ * single-shot frame, so the estimate errs on the small side.
+ *
+ * Return: estimated prefix length, 0 if nothing fits or on error.
+ */
+static size_t qrcon_stream_estimate(const u8 *src, size_t src_size, u8 *scratch,
+                                    size_t scratch_size, size_t payload_cap, int level)
+{
+    ZSTD_inBuffer in = { src, 0, 0 };
+    ZSTD_outBuffer out = { scratch, scratch_size, 0 };
+    size_t produced = 0, fit = 0;
+    size_t room, step, ret;
+
+    if (src_size > payload_cap * QRCON_FILL_WINDOW_RATIO)
+        src_size = payload_cap * QRCON_FILL_WINDOW_RATIO;
+
+    qrcon_zstd_begin(level, &zstd_cparams);
+    /* Bounded window keeps the context small; the frame is never finished */
+    ZSTD_CCtx_setPledgedSrcSize(cctx, src_size);
+
+    while (in.size < src_size) {
+        if (produced + QRCON_ZSTD_EPILOGUE_SIZE >= payload_cap)
+            break;
+        room = payload_cap - QRCON_ZSTD_EPILOGUE_SIZE - produced;
+
+        /* Aim for half the remaining room at the ratio seen so far */
+        if (produced > 0 && in.size > produced)
+            step = room * in.size / produced / 2;
+        else
+            step = room;
+        if (step < QRCON_FILL_MIN_STEP)
+            step = QRCON_FILL_MIN_STEP;
+        in.size = (src_size - in.size > step) ? in.size + step : src_size;
+
+        do {
+            out.pos = 0;
+            ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_flush);
+            if (ZSTD_isError(ret)) {
+                pr_debug("qrcon: ZSTD stream err (%s) at %zu bytes\n",
+                         ZSTD_getErrorName(ret), in.pos);
+                return fit;
+            }
+            produced += out.pos;
+        } while (ret != 0);
+
+        if (produced + QRCON_ZSTD_EPILOGUE_SIZE > payload_cap)
+            break;
+        fit = in.size;
+    }
+
+    return fit;
+}
+
+/* Forget all sequence numbers, the history buffer was emptied */
+static void qrcon_seq_reset(void)
+{
+    line_refs_off = SIZE_MAX;
+    seq_anchor_count = 0;
+    history_next_seq = 0;
+    seq_cursor.off = SIZE_MAX;
+}
+
+static void qrcon_seq_anchor(size_t off, u64 seq)
+{
+    if (seq_anchor_count == QRCON_SEQ_ANCHORS) {
+        pr_warn_once("qrcon: Too many printk sequence gaps, sequence numbers will be off\n");
+        return;
+    }
+    seq_anchors[seq_anchor_count].off = off;
+    seq_anchors[seq_anchor_count].seq = seq;
+    seq_anchor_count++;
+}
+
+/* Return: sequence number of the line containing history offset @off */
+static u64 qrcon_history_seq(size_t off)
+{
+    struct qrcon_seq_anchor from;
+    unsigned int i = 0;
+    const u8 *p, *end;
+
+    if (!seq_anchor_count)
+        return 0;
+    while (i + 1 < seq_anchor_count && seq_anchors[i + 1].off <= off)
+        i++;
+    from = seq_anchors[i];
+    /* Continue from the last lookup when no anchor lies in between */
+    if (seq_cursor.off != SIZE_MAX && seq_cursor.off >= from.off && seq_cursor.off <= off)
+        from = seq_cursor;
+
+    p = kmsg_history_buf + from.off;
+    end = kmsg_history_buf + off;
+    while (p < end && (p = memchr(p, '\n', end - p))) {
+        from.seq++;
+        p++;
+    }
+
+    seq_cursor.off = off;
+    seq_cursor.seq = from.seq;
+    return from.seq;
+}
+
+/* The first @cut bytes of the history buffer were discarded */
+static void qrcon_seq_rebase(size_t cut)
+{
+    unsigned int i, kept = 0;
+    u64 seq = qrcon_history_seq(cut);
+
+    /* Anchor the new first line, then shift the anchors after it */
+    for (i = 0; i < seq_anchor_count; i++) {
+        if (seq_anchors[i].off <= cut)
+            continue;
+        seq_anchors[++kept].off = seq_anchors[i].off - cut;
+        seq_anchors[kept].seq = seq_anchors[i].seq;
+    }
+    seq_anchors[0].off = 0;
+    seq_anchors[0].seq = seq;
+    seq_anchor_count = kept + 1;
+    seq_cursor.off = 0;
+    seq_cursor.seq = seq;
+}
+
+static size_t qrcon_put_varint(u8 *dst, u64 val)
+{
+    size_t n = 0;
+
+    while (val >= 0x80) {
+        dst[n++] = (u8)val | 0x80;
+        val >>= 7;
+    }
+    dst[n++] = (u8)val;
+    return n;
+}
+
+static size_t qrcon_varint_len(u64 val)
+{
+    size_t n = 1;
+
+    while (val >= 0x80) {
+        val >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static bool qrcon_pi_active(void)
+{
+    return printk_index && pi_count;
+}
+
+#ifdef QRCON_PRINTK_INDEX
+/* Build the format of an index entry as debugfs lists it: the subsystem
+ * prefix, then the format without its level. The trailing newline is left
+ * out, records have none.
+ *
+ * Return: length in buf, 0 for continuation fragments and formats too long.
+ */
+static size_t qrcon_pi_format(const struct pi_entry *entry, char *buf, size_t size)
+{
+    const char *fmt = entry->fmt;
+    size_t prefix_len = 0, len;
+
+    while (fmt[0] == KERN_SOH_ASCII && fmt[1]) {
+        if (fmt[1] == 'c')
+            return 0;
+        fmt += 2;
+    }
+    if (entry->subsys_fmt_prefix)
+        prefix_len = strlen(entry->subsys_fmt_prefix);
+    len = strlen(fmt);
+    if (len && fmt[len - 1] == '\n')
+        len--;
+    if (!len || prefix_len + len >= size)
+        return 0;
+
+    if (prefix_len)
+        memcpy(buf, entry->subsys_fmt_prefix, prefix_len);
+    memcpy(buf + prefix_len, fmt, len);
+    buf[prefix_len + len] = '\0';
+    return prefix_len + len;
+}
+
+/* Formats are looked up by the literal text at their start, or after the
+ * first ": " when they start with a conversion ("%s %s: " device prefixes,
+ * "%s: " function names).
+ *
+ * Return: offset of the key in fmt, -1 if it has no usable key.
+ */
+static int qrcon_pi_key_off(const char *fmt, size_t len)
+{
+    const char *p;
+    size_t off = 0;
+
+    if (fmt[0] == '%') {
+        p = strnstr(fmt, ": ", min_t(size_t, len, QRCON_PI_SCAN_LEN));
+        if (!p)
+            return -1;
+        off = p + 2 - fmt;
+    }
+    if (off + QRCON_PI_KEY_LEN > len || memchr(fmt + off, '%', QRCON_PI_KEY_LEN))
+        return -1;
+    return off;
+}
+
+static u32 qrcon_pi_hash(const void *key)
+{
+    return jhash(key, QRCON_PI_KEY_LEN, 0) & ((1 << QRCON_PI_HASH_BITS) - 1);
+}
+
+/* Parse the conversion at fmt[0] == '%' the way vsnprintf() does.
+ * Return: the format after it, NULL if its output cannot be told apart.
+ */
+static const char *qrcon_pi_spec(const char *fmt, u8 *type)
+{
+    fmt++;
+    while (*fmt && strchr("-+ #0", *fmt))
+        fmt++;
+    if (*fmt == '*')
+        fmt++;
+    else
+        while (isdigit(*fmt))
+            fmt++;
+    if (*fmt == '.') {
+        fmt++;
+        if (*fmt == '*')
+            fmt++;
+        else
+            while (isdigit(*fmt))
+                fmt++;
+    }
+    while (*fmt && strchr("hlLqjzt", *fmt))
+        fmt++;
+
+    switch (*fmt++) {
+    case 'd':
+    case 'i':
+        *type = QRCON_PI_ARG_DEC;
+        break;
+    case 'u':
+        *type = QRCON_PI_ARG_UDEC;
+        break;
+    case 'x':
+        *type = QRCON_PI_ARG_HEX;
+        break;
+    case 'X':
+        *type = QRCON_PI_ARG_HEXU;
+        break;
+    case 'c':
+    case 's':
+    case 'o':
+        *type = QRCON_PI_ARG_TEXT;
+        break;
+    case 'p':
+        /* Extensions such as %pS or %pI4 */
+        *type = QRCON_PI_ARG_TEXT;
+        while (isalnum(*fmt))
+            fmt++;
+        break;
+    default:
+        return NULL;
+    }
+    return fmt;
+}
+
+/* Match text[off, len) against fmt, recording where each conversion's
+ * output lies. A conversion takes as little text as it can, and more when
+ * the rest of the format does not match; @budget bounds the retries.
+ *
+ * Return: number of conversions, -1 if the text does not match.
+ */
+static int qrcon_pi_match(const char *fmt, const u8 *text, size_t len, size_t off,
+                          struct qrcon_pi_arg *args, int nargs, int *budget)
+{
+    const char *next;
+    const u8 *p;
+    size_t end;
+    u8 type;
+    int ret;
+
+    while (*fmt) {
+        if (fmt[0] != '%' || fmt[1] == '%') {
+            if (off == len || text[off] != (u8)fmt[0])
+                return -1;
+            off++;
+            fmt += (fmt[0] == '%') ? 2 : 1;
+            continue;
+        }
+
+        next = qrcon_pi_spec(fmt, &type);
+        if (!next || nargs == QRCON_PI_MAX_ARGS)
+            return -1;
+        args[nargs].off = off;
+        args[nargs].type = type;
+        /* The last conversion takes the rest of the line */
+        if (!*next) {
+            args[nargs].len = len - off;
+            return nargs + 1;
+        }
+        for (end = off; end <= len; end++) {
+            /* Only try ends followed by the literal after the conversion */
+            if (next[0] != '%' || next[1] == '%') {
+                p = memchr(text + end, next[0], len - end);
+                if (!p)
+                    break;
+                end = p - text;
+            }
+            if ((*budget)-- <= 0)
+                return -1;
+            args[nargs].len = end - off;
+            ret = qrcon_pi_match(next, text, len, end, args, nargs + 1, budget);
+            if (ret >= 0)
+                return ret;
+        }
+        return -1;
+    }
+    return (off == len) ? nargs : -1;
+}
+
+/* Find the index entry whose format renders as text[0, len), trying the
+ * formats keyed by the start of the line and by the text after each ": "
+ * near it.
+ *
+ * Return: entry ID + 1, 0 if no format matches.
+ */
+static u32 qrcon_pi_lookup(const u8 *text, size_t len, struct qrcon_pi_arg *args, int *nargs)
+{
+    const struct pi_entry *entry;
+    size_t off = 0, fmt_len, scan = min_t(size_t, len, QRCON_PI_SCAN_LEN);
+    int key_off, budget;
+    u32 id;
+
+    for (;;) {
+        for (id = (off + QRCON_PI_KEY_LEN <= len) ? pi_hash[qrcon_pi_hash(text + off)] : 0;
+             id; id = pi_slots[id - 1].next) {
+            entry = __start_printk_index[pi_slots[id - 1].pos];
+            fmt_len = qrcon_pi_format(entry, pi_fmt_buf, sizeof(pi_fmt_buf));
+            key_off = qrcon_pi_key_off(pi_fmt_buf, fmt_len);
+            /* Skip hash collisions before the full match */
+            if (memcmp(pi_fmt_buf + key_off, text + off, QRCON_PI_KEY_LEN))
+                continue;
+            budget = QRCON_PI_MATCH_BUDGET;
+            *nargs = qrcon_pi_match(pi_fmt_buf, text, len, 0, args, 0, &budget);
+            if (*nargs >= 0)
+                return id;
+        }
+
+        /* Move past the next ": " */
+        do {
+            if (++off >= scan)
+                return 0;
+        } while (off < 2 || text[off - 2] != ':' || text[off - 1] != ' ');
+    }
+}
+
+static void qrcon_init_printk_index(void)
+{
+    struct pi_entry **entry;
+    size_t fmt_len;
+    int key_off;
+    u32 id, h, count = 0;
+
+    if (!printk_index)
+        return;
+
+    for (entry = __start_printk_index; entry < __stop_printk_index; entry++)
+        if (*entry && (*entry)->fmt)
+            count++;
+    pi_slots = kvmalloc_array(min_t(u32, count, QRCON_PI_MAX_ENTRIES), sizeof(*pi_slots), GFP_KERNEL);
+    if (!pi_slots) {
+        pr_warn("qrcon: No memory for %u printk index formats, sending text\n", count);
+        return;
+    }
+
+    for (entry = __start_printk_index; entry < __stop_printk_index; entry++) {
+        if (!*entry || !(*entry)->fmt)
+            continue;
+        id = pi_count++;
+        if (id >= QRCON_PI_MAX_ENTRIES)
+            continue;
+
+        fmt_len = qrcon_pi_format(*entry, pi_fmt_buf, sizeof(pi_fmt_buf));
+        if (!fmt_len)
+            continue;
+        key_off = qrcon_pi_key_off(pi_fmt_buf, fmt_len);
+        if (key_off < 0)
+            continue;
+        h = qrcon_pi_hash(pi_fmt_buf + key_off);
+        pi_slots[id].pos = entry - __start_printk_index;
+        pi_slots[id].next = pi_hash[h];
+        pi_hash[h] = id + 1;
+    }
+
+    if (pi_count > QRCON_PI_MAX_ENTRIES)
+        pr_warn("qrcon: Only the first %d of %u printk index formats are used\n",
+                QRCON_PI_MAX_ENTRIES, pi_count);
+    pr_info("qrcon: printk index has %u formats\n", pi_count);
+}
+
+static void qrcon_exit_printk_index(void)
+{
+    kvfree(pi_slots);
+}
+#else
+static u32 qrcon_pi_lookup(const u8 *text, size_t len, struct qrcon_pi_arg *args, int *nargs)
+{
+    return 0;
+}
+
+static void qrcon_init_printk_index(void)
+{
+}
+
+static void qrcon_exit_printk_index(void)
+{
+}
+#endif
+
+/* Value of a numeric conversion's output, if printing it back gives the
+ * same text (no padding, sign or leading zeros).
+ */
+static bool qrcon_pi_number(const u8 *s, size_t len, u8 type, u64 *val)
+{
+    unsigned int base = (type == QRCON_PI_ARG_HEX || type == QRCON_PI_ARG_HEXU) ? 16 : 10;
+    bool neg = false;
+    u64 v = 0;
+    size_t i;
+    u8 c;
+
+    if (type == QRCON_PI_ARG_DEC && len && s[0] == '-') {
+        neg = true;
+        s++;
+        len--;
+    }
+    /* Keeps the value, shifted and zigzagged, within a u64 */
+    if (!len || len > (base == 16 ? 15 : 18) || (s[0] == '0' && (len > 1 || neg)))
+        return false;
+
+    for (i = 0; i < len; i++) {
+        c = s[i];
+        if (c >= '0' && c <= '9')
+            c -= '0';
+        else if (type == QRCON_PI_ARG_HEX && c >= 'a' && c <= 'f')
+            c -= 'a' - 10;
+        else if (type == QRCON_PI_ARG_HEXU && c >= 'A' && c <= 'F')
+            c -= 'A' - 10;
+        else
+            return false;
+        v = v * base + c;
+    }
+
+    *val = (type == QRCON_PI_ARG_DEC) ? (neg ? 2 * v - 1 : 2 * v) : v;
+    return true;
+}
+
+/* Write the conversion outputs of a referenced record to dst, or only size
+ * them with a NULL dst. Numbers that print back the same are sent as
+ * varint value << 1, anything else as its length (<< 1 | 1 for numeric
+ * conversions) and text.
+ *
+ * Return: bytes written.
+ */
+static size_t qrcon_pi_put_args(u8 *dst, const u8 *text, const struct qrcon_pi_arg *args, int nargs)
+{
+    size_t n = 0;
+    u64 val, head;
+    int i;
+
+    for (i = 0; i < nargs; i++) {
+        if (args[i].type != QRCON_PI_ARG_TEXT &&
+            qrcon_pi_number(text + args[i].off, args[i].len, args[i].type, &val)) {
+            n += dst ? qrcon_put_varint(dst + n, val << 1) : qrcon_varint_len(val << 1);
+            continue;
+        }
+
+        head = (args[i].type == QRCON_PI_ARG_TEXT) ? args[i].len : (u64)args[i].len << 1 | 1;
+        n += dst ? qrcon_put_varint(dst + n, head) : qrcon_varint_len(head);
+        if (dst)
+            memcpy(dst + n, text + args[i].off, args[i].len);
+        n += args[i].len;
+    }
+    return n;
+}
+
+static bool qrcon_trace_active(void)
+{
+#ifdef QRCON_TRACE_SYMBOLS
+    return trace_encoding;
+#else
+    return false;
+#endif
+}
+
+#ifdef QRCON_TRACE_SYMBOLS
+static unsigned long qrcon_sym_lookup(const char *name, size_t len)
+{
+    u32 hash = jhash(name, len, 0);
+    struct qrcon_sym_cache_entry *entry = &qrcon_sym_cache[hash & ((1 << QRCON_SYM_CACHE_BITS) - 1)];
+
+    if (!entry->valid || entry->hash != hash) {
+        entry->hash = hash;
+        entry->addr = kallsyms_lookup_name(name);
+        entry->valid = true;
+    }
+    return entry->addr;
+}
+
+/* Parse the "0x" prefixed hex number at text[i].
+ * Return: index after it, 0 if there is none.
+ */
+static size_t qrcon_parse_hex(const u8 *text, size_t len, size_t i, unsigned long *val)
+{
+    size_t start;
+
+    if (i + 2 >= len || text[i] != '0' || text[i + 1] != 'x')
+        return 0;
+    *val = 0;
+    for (i += 2, start = i; i < len && isxdigit(text[i]) && !isupper(text[i]); i++)
+        *val = (*val << 4) | hex_to_bin(text[i]);
+    return (i > start && i - start <= 2 * sizeof(long)) ? i : 0;
+}
+
+/* Recognise a call trace frame printed by %pS or %pB for a symbol of the
+ * kernel image, whose address prints back the same. Frames of modules
+ * are left as text, System.map does not know them.
+ *
+ * Return: true if the frame can be sent as an address.
+ */
+static bool qrcon_trace_parse(const u8 *text, size_t len, struct qrcon_trace_frame *frame)
+{
+    unsigned long sym, off, size;
+    size_t i = 0, name_off, name_len;
+
+    while (i < len && i < QRCON_TRACE_MAX_INDENT && text[i] == ' ')
+        i++;
+    frame->indent = i;
+    frame->unreliable = i + 1 < len && text[i] == '?' && text[i + 1] == ' ';
+    if (frame->unreliable)
+        i += 2;
+
+    name_off = i;
+    while (i < len && (isalnum(text[i]) || text[i] == '_' || text[i] == '.' || text[i] == '$'))
+        i++;
+    name_len = i - name_off;
+    if (!name_len || name_len >= KSYM_NAME_LEN || i == len || text[i] != '+')
+        return false;
+    i = qrcon_parse_hex(text, len, i + 1, &off);
+    if (!i || i == len || text[i] != '/')
+        return false;
+    i = qrcon_parse_hex(text, len, i + 1, &size);
+    if (!i || (i + 1 < len && text[i] == ' ' && text[i + 1] == '['))
+        return false;
+    /* At offset == size, as %pB prints return addresses at the very end of
+     * a function, the address is also the start of the next symbol, which
+     * the name hash alone cannot tell apart. Such frames stay text.
+     */
+    if (off >= size)
+        return false;
+
+    memcpy(qrcon_sym_name, text + name_off, name_len);
+    qrcon_sym_name[name_len] = '\0';
+    sym = qrcon_sym_lookup(qrcon_sym_name, name_len);
+    if (!sym || sym < (unsigned long)_text)
+        return false;
+
+    /* Another static function of the same name */
+    sprint_symbol(qrcon_sym_buf, sym + off);
+    if (strlen(qrcon_sym_buf) != i - name_off || memcmp(qrcon_sym_buf, text + name_off, i - name_off))
+        return false;
+
+    frame->addr = sym + off - (unsigned long)_text;
+    frame->size = size;
+    frame->hash = ~crc32_le(~0, qrcon_sym_name, name_len);
+    frame->tail_off = i;
+    frame->tail_len = len - i;
+    return true;
+}
+#else
+static bool qrcon_trace_parse(const u8 *text, size_t len, struct qrcon_trace_frame *frame)
+{
+    return false;
+}
+#endif
+
+/* Write a call trace frame to dst, or only size it with a NULL dst:
+ *   varint  indent << 2 | unreliable << 1 | has tail
+ *   varint  address relative to _text
+ *   varint  symbol size
+ *   u8      low byte of the CRC32 of the symbol name
+ *   varint  tail length, then the tail, if any
+ *
+ * Return: bytes written.
+ */
+static size_t qrcon_trace_put(u8 *dst, const u8 *text, const struct qrcon_trace_frame *frame)
+{
+    u64 head = frame->indent << 2 | frame->unreliable << 1 | (frame->tail_len != 0);
+    size_t n;
+
+    if (!dst) {
+        n = qrcon_varint_len(head) + qrcon_varint_len(frame->addr) + qrcon_varint_len(frame->size) + 1;
+        if (frame->tail_len)
+            n += qrcon_varint_len(frame->tail_len) + frame->tail_len;
+        return n;
+    }
+
+    n = qrcon_put_varint(dst, head);
+    n += qrcon_put_varint(dst + n, frame->addr);
+    n += qrcon_put_varint(dst + n, frame->size);
+    dst[n++] = frame->hash;
+    if (frame->tail_len) {
+        n += qrcon_put_varint(dst + n, frame->tail_len);
+        memcpy(dst + n, text + frame->tail_off, frame->tail_len);
+        n += frame->tail_len;
+    }
+    return n;
+}
+
+/* Parse the "<level>[sssss.uuuuuu] " syslog prefix of a line.
+ * Only prefixes that print back identically are accepted.
+ *
+ * Return: prefix length, or 0 if the line does not start with one.
+ */
+static size_t qrcon_parse_prefix(const u8 *line, size_t len, u8 *level, u64 *usec)
+{
+    size_t i = 1, digits, spaces;
+    u64 sec = 0, frac = 0;
+    unsigned int lvl = 0;
+
+    if (len < 4 || line[0] != '<')
+        return 0;
+    for (digits = 0; i < len && line[i] >= '0' && line[i] <= '9'; i++, digits++)
+        lvl = lvl * 10 + line[i] - '0';
+    if (!digits || digits > 3 || lvl >= QRCON_RECORD_RAW || (digits > 1 && line[1] == '0'))
+        return 0;
+    if (i + 2 > len || line[i] != '>' || line[i + 1] != '[')
+        return 0;
+    i += 2;
+
+    /* Seconds are right-aligned in at least 5 columns */
+    for (spaces = 0; i < len && line[i] == ' '; i++)
+        spaces++;
+    for (digits = 0; i < len && line[i] >= '0' && line[i] <= '9'; i++, digits++)
+        sec = sec * 10 + line[i] - '0';
+    if (!digits || digits > 12 || (digits < 5 ? spaces + digits != 5 : spaces != 0) ||
+        (digits > 1 && line[i - digits] == '0'))
+        return 0;
+    if (i + 9 > len || line[i] != '.')
+        return 0;
+    for (digits = 0, i++; digits < 6; i++, digits++) {
+        if (line[i] < '0' || line[i] > '9')
+            return 0;
+        frac = frac * 10 + line[i] - '0';
+    }
+    if (line[i] != ']' || line[i + 1] != ' ')
+        return 0;
+
+    *level = lvl;
+    *usec = sec * 1000000 + frac;
+    return i + 2;
+}
+
+/* What the complete line @line of the frame being packed is sent as, from
+ * line_refs when it was looked up before. Lines are cached in order while
+ * there is room, the rest are looked up every time.
+ */
+static u32 qrcon_line_ref(unsigned int line, const u8 *text, size_t len, bool pi, bool traces,
+                          struct qrcon_pi_arg *args, int *nargs, struct qrcon_trace_frame *frame)
+{
+    struct qrcon_line_ref *cached;
+    u32 ref = QRCON_REF_TEXT, id;
+
+    if (line < line_refs_count) {
+        cached = &line_refs[line];
+        if (cached->ref == QRCON_REF_TRACE)
+            *frame = line_frames[cached->first];
+        *nargs = cached->nargs;
+        memcpy(args, line_args + cached->first, cached->nargs * sizeof(*args));
+        return cached->ref;
+    }
 
-    /* Draw white border */
-    qrcon_draw_rect(start_x - qr_border, start_y - qr_border,
-                    qr_render_width + 2 * qr_border,
-                    qr_render_width + 2 * qr_border, white);
+    if (traces && qrcon_trace_parse(text, len, frame))
+        ref = QRCON_REF_TRACE;
+    else if (pi && (id = qrcon_pi_lookup(text, len, args, nargs)))
+        ref = QRCON_REF_FORMAT + id - 1;
+
+    if (line != line_refs_count || line == QRCON_LINE_REFS)
+        return ref;
+    cached = &line_refs[line];
+    cached->ref = ref;
+    cached->first = 0;
+    cached->nargs = 0;
+    if (ref == QRCON_REF_TRACE) {
+        if (line_frames_count == QRCON_LINE_FRAMES)
+            return ref;
+        cached->first = line_frames_count;
+        line_frames[line_frames_count++] = *frame;
+    } else if (ref >= QRCON_REF_FORMAT) {
+        if (line_args_count + *nargs > QRCON_LINE_ARGS)
+            return ref;
+        cached->first = line_args_count;
+        cached->nargs = *nargs;
+        memcpy(line_args + line_args_count, args, *nargs * sizeof(*args));
+        line_args_count += *nargs;
+    }
+    line_refs_count++;
+    return ref;
+}
 
-    /* Render QR modules (black squares) from the generated image */
-    qr_image_ptr = qr_payload_and_image_buf;
-    for (y = 0; y < qr_width; y++) {
-        for (x = 0; x < qr_width; x++) {
-            u8 byte = qr_image_ptr[y * ((qr_width + 7) / 8) + (x / 8)];
-            u8 bit = 0x80 >> (x % 8);
-            if (byte & bit) {
-                qrcon_draw_rect(start_x + x * block_size, start_y + y * block_size,
-                                block_size, block_size, black);
+/* Transform history lines into columns:
+ *   varint  line count
+ *   u8      level per line, QRCON_RECORD_RAW for lines kept verbatim
+ *   varint  timestamp per prefixed line, zigzag microsecond delta
+ *   varint  sequence number of the first line, then the delta per line
+ * With the printk index (QRCON_FRAME_PRINTK):
+ *   varint  number of index entries, to check the decoder's copy
+ * With the printk index or call trace frames (QRCON_FRAME_TRACE):
+ *   varint  QRCON_REF_* per line
+ *   varint  size of the arguments, then the conversion outputs or trace
+ *           frame of each line not sent as text
+ * and last:
+ *   text    each line sent as text, without its prefix, '\n' terminated
+ * Timestamps and sequence numbers barely change from line to line, so the
+ * deltas compress far better than the digits did inside the text.
+ * A frame may start or end mid-line; the partial lines are kept verbatim
+ * (the last one without its '\n'), so frames still decode to the same bytes.
+ *
+ * Return: packed size, 0 if it does not fit in dst_size.
+ */
+static size_t qrcon_records_pack(const u8 *src, size_t len, u8 *dst, size_t dst_size)
+{
+    struct qrcon_pi_arg args[QRCON_PI_MAX_ARGS];
+    struct qrcon_trace_frame frame;
+    size_t off = src - kmsg_history_buf;
+    size_t n = 0, level_pos = 0, ts_pos = 0, seq_pos = 0, ref_pos = 0, arg_pos = 0, text_pos = 0;
+    size_t ts_size = 0, seq_size = 0, ref_size = 0, arg_size = 0, text_size = 0, total = 0;
+    size_t line_len, prefix;
+    bool pi = qrcon_pi_active(), traces = qrcon_trace_active(), refs = pi || traces;
+    unsigned int anchor, line;
+    const u8 *p, *nl, *end = src + len;
+    u64 seq, prev_seq, usec = 0, prev_usec;
+    s64 delta;
+    u32 ref;
+    u8 level;
+    int pass, nargs = 0;
+
+    /* Lines looked up for another frame start are no use */
+    if (off != line_refs_off) {
+        line_refs_count = 0;
+        line_args_count = 0;
+        line_frames_count = 0;
+        line_refs_off = off;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        seq = prev_seq = qrcon_history_seq(off);
+        prev_usec = 0;
+        anchor = 0;
+        while (anchor < seq_anchor_count && seq_anchors[anchor].off <= off)
+            anchor++;
+
+        if (pass == 1) {
+            level_pos = qrcon_put_varint(dst, n);
+            ts_pos = level_pos + n;
+            seq_pos = ts_pos + ts_size;
+            text_pos = seq_pos + seq_size;
+            if (pi)
+                text_pos += qrcon_put_varint(dst + text_pos, pi_count);
+            if (refs) {
+                ref_pos = text_pos;
+                arg_pos = ref_pos + ref_size;
+                arg_pos += qrcon_put_varint(dst + arg_pos, arg_size);
+                text_pos = arg_pos + arg_size;
+            }
+            n = 0;
+        }
+
+        for (p = src, line = 0; p < end; p += line_len, line++) {
+            nl = memchr(p, '\n', end - p);
+            line_len = nl ? nl - p + 1 : end - p;
+
+            /* Next line of this record, or an anchored one */
+            if (p != src) {
+                seq++;
+                if (anchor < seq_anchor_count && seq_anchors[anchor].off == p - kmsg_history_buf)
+                    seq = seq_anchors[anchor++].seq;
+            }
+
+            /* A cut-off last line stays verbatim, its text must not be empty */
+            prefix = nl ? qrcon_parse_prefix(p, line_len, &level, &usec) : 0;
+            if (!prefix)
+                level = QRCON_RECORD_RAW;
+            delta = usec - prev_usec;
+            ref = QRCON_REF_TEXT;
+            if (nl && refs)
+                ref = qrcon_line_ref(line, p + prefix, line_len - prefix - 1, prefix && pi,
+                                     prefix && traces, args, &nargs, &frame);
+
+            if (pass == 0) {
+                if (prefix)
+                    ts_size += qrcon_varint_len(((u64)delta << 1) ^ (u64)(delta >> 63));
+                seq_size += qrcon_varint_len(p == src ? seq : seq - prev_seq);
+                if (refs)
+                    ref_size += qrcon_varint_len(ref);
+                if (ref == QRCON_REF_TRACE)
+                    arg_size += qrcon_trace_put(NULL, p + prefix, &frame);
+                else if (ref)
+                    arg_size += qrcon_pi_put_args(NULL, p + prefix, args, nargs);
+                else
+                    text_size += line_len - prefix;
+                n++;
+            } else {
+                dst[level_pos + n++] = level;
+                if (prefix)
+                    ts_pos += qrcon_put_varint(dst + ts_pos, ((u64)delta << 1) ^ (u64)(delta >> 63));
+                seq_pos += qrcon_put_varint(dst + seq_pos, p == src ? seq : seq - prev_seq);
+                if (refs)
+                    ref_pos += qrcon_put_varint(dst + ref_pos, ref);
+                if (ref == QRCON_REF_TRACE) {
+                    arg_pos += qrcon_trace_put(dst + arg_pos, p + prefix, &frame);
+                } else if (ref) {
+                    arg_pos += qrcon_pi_put_args(dst + arg_pos, p + prefix, args, nargs);
+                } else {
+                    memcpy(dst + text_pos, p + prefix, line_len - prefix);
+                    text_pos += line_len - prefix;
+                }
             }
+            if (prefix)
+                prev_usec = usec;
+            prev_seq = seq;
+        }
+
+        if (pass == 0) {
+            total = qrcon_varint_len(n) + n + ts_size + seq_size + text_size;
+            if (pi)
+                total += qrcon_varint_len(pi_count);
+            if (refs)
+                total += ref_size + qrcon_varint_len(arg_size) + arg_size;
+            if (total > dst_size)
+                return 0;
         }
     }
+    return total;
+}
 
-    /* Force framebuffer update to immediately display the QR code */
-    if (fb_info && fb_info->fbops && fb_info->fbops->fb_pan_display) {
-        struct fb_var_screeninfo var = fb_info->var;
-        fb_info->fbops->fb_pan_display(&var, fb_info);
+/* Single-shot compressor for qrcon_fill_search.
+ * Return: compressed size, 0 on error or if the output exceeded dst_size.
+ */
+typedef size_t (*qrcon_compress_fn)(const u8 *src, size_t src_size, u8 *dst, size_t dst_size);
+
+/* Find the longest prefix of src whose compressed size fits payload_cap.
+ * Starting from @guess, the prefix is refined with a few single-shot
+ * compressions, interpolating between the largest prefix known to fit and
+ * the smallest known not to. Attempts may overshoot into the rest of
+ * dst_size, so their size is known. Every attempt only touches about one
+ * frame worth of input, so the cost per frame does not depend on src_size.
+ *
+ * Return: compressed size of the prefix left in dst, 0 if nothing fits.
+ */
+static size_t qrcon_fill_search(qrcon_compress_fn compress, const u8 *src, size_t src_size,
+                                u8 *dst, size_t dst_size, size_t payload_cap,
+                                size_t guess, size_t *processed_size)
+{
+    size_t compressed_size;
+    size_t lo = 0, hi = src_size + 1; /* lo fits, hi does not */
+    size_t lo_size = 0, hi_size = 0; /* Compressed sizes, hi_size 0 if unknown */
+    size_t next;
+    bool dst_holds_lo = false;
+    int tries;
+
+    *processed_size = 0;
+
+    if (guess == 0 || guess > src_size)
+        guess = (src_size < payload_cap) ? src_size : payload_cap;
+
+    for (tries = 0; tries < QRCON_FILL_MAX_TRIES; tries++) {
+        compressed_size = compress(src, guess, dst, dst_size);
+
+        if (compressed_size && compressed_size <= payload_cap) {
+            lo = guess;
+            lo_size = compressed_size;
+            dst_holds_lo = true;
+            /* Done once everything fits or the frame is full enough */
+            if (lo == src_size || payload_cap - lo_size <= QRCON_FILL_SLACK)
+                break;
+            /* Extrapolate with this prefix's ratio */
+            next = lo + (payload_cap - lo_size) * lo / lo_size;
+        } else {
+            hi = guess;
+            hi_size = compressed_size;
+            dst_holds_lo = false;
+            /* Interpolate between the two bounds when both sizes are known */
+            if (hi_size && lo_size)
+                next = lo + (payload_cap - lo_size) * (hi - lo) / (hi_size - lo_size);
+            else if (hi_size)
+                /* At least a granule down, tiny inputs do not shrink in proportion */
+                next = min(hi * payload_cap / hi_size,
+                           hi > QRCON_FILL_GRANULE ? hi - QRCON_FILL_GRANULE : 0);
+            else
+                next = lo + (hi - lo) / 2;
+        }
+
+        /* Stay strictly inside the bracket, and stop once it is tight */
+        if (next > src_size)
+            next = src_size;
+        if (next >= hi)
+            next = lo + (hi - lo) / 2;
+        if (next <= lo)
+            next = lo + 1;
+        if ((lo && hi - lo <= QRCON_FILL_GRANULE) || next >= hi)
+            break;
+        guess = next;
     }
 
-    pr_debug("qrcon: QR code rendered at (%d,%d), size %dx%d\n",
-            start_x, start_y, qr_render_width, qr_render_width);
-    return 0;
+    if (lo == 0)
+        return 0;
+
+    if (!dst_holds_lo) {
+        /* The last attempt overflowed, redo the best one that fit */
+        compressed_size = compress(src, lo, dst, dst_size);
+        if (compressed_size != lo_size) {
+            pr_err("qrcon: Final compression of %zu bytes gave %zu, expected %zu\n",
+                   lo, compressed_size, lo_size);
+            return 0;
+        }
+    }
+
+    pr_debug("qrcon: Fill search settled on %zu -> %zu bytes in %d tries\n",
+             lo, lo_size, tries + 1);
+    *processed_size = lo;
+    return lo_size;
 }
 
-/* Initialize compression */
-static int qrcon_init_compression(void)
+static size_t qrcon_zstd_compress(const u8 *src, size_t src_size, u8 *dst, size_t dst_size)
 {
-    size_t required_size;
-    
-    /* Validate compression level */
-    if (compression_level < 1 || compression_level > 22) {
-        pr_err("qrcon: Invalid compression_level %d, must be between 1 and 22.\n", compression_level);
-        return -EINVAL;
-    }
+    size_t ret;
 
-    required_size = ZSTD_estimateCCtxSize(compression_level);
+    qrcon_zstd_begin(clamp(compression_level, 1, 22), &zstd_cparams);
+    ret = ZSTD_compress2(cctx, dst, dst_size, src, src_size);
 
-    /* Check if the required size exceeds our static buffer */
-    if (required_size > QRCON_ZSTD_WORKSPACE_SIZE) {
-        pr_err("qrcon: ZSTD Level %d requires %zu bytes, exceeding static buffer size %d. Reduce compression_level or increase QRCON_ZSTD_WORKSPACE_SIZE.\n",
-               compression_level, required_size, QRCON_ZSTD_WORKSPACE_SIZE);
-        return -ENOMEM;
+    if (ZSTD_isError(ret)) {
+        pr_debug("qrcon: ZSTD err (%s) compressing %zu bytes\n",
+                 ZSTD_getErrorName(ret), src_size);
+        return 0;
     }
+    return ret;
+}
 
-    pr_debug("qrcon: Using compression level %d (requires %zu bytes, static buffer %d bytes).\n",
-            compression_level, required_size, QRCON_ZSTD_WORKSPACE_SIZE);
+/* zstd: a streaming pass estimates the fill point, single shots refine it */
+static size_t qrcon_zstd_fill(const u8 *src, size_t src_size, u8 *dst, size_t dst_size,
+                              size_t payload_cap, size_t *processed_size)
+{
+    int level = clamp(compression_level, 1, 22);
+    size_t guess;
 
-    cctx = ZSTD_initStaticCCtx(zstd_static_workspace, QRCON_ZSTD_WORKSPACE_SIZE);
+    guess = qrcon_stream_estimate(src, src_size, dst, dst_size, payload_cap, level);
+    return qrcon_fill_search(qrcon_zstd_compress, src, src_size, dst, dst_size,
+                             payload_cap, guess, processed_size);
+}
 
-    if (!cctx) {
-        pr_err("qrcon: Failed to initialize static ZSTD context.\n");
-        return -ENOMEM;
+/* LZ4: the block compressor fills the destination by itself */
+static size_t qrcon_lz4_fill(const u8 *src, size_t src_size, u8 *dst, size_t dst_size,
+                             size_t payload_cap, size_t *processed_size)
+{
+    int consumed = min_t(size_t, src_size, INT_MAX);
+    int ret;
+
+    ret = LZ4_compress_destSize((const char *)src, (char *)dst, &consumed,
+                                payload_cap, lz4_workspace);
+    if (ret <= 0) {
+        *processed_size = 0;
+        return 0;
     }
+    *processed_size = consumed;
+    return ret;
+}
 
-    return 0;
+static size_t qrcon_lz4_compress(const u8 *src, size_t src_size, u8 *dst, size_t dst_size)
+{
+    int ret = LZ4_compress_default((const char *)src, (char *)dst, src_size, dst_size,
+                                   lz4_workspace);
+
+    return (ret > 0) ? ret : 0;
+}
+
+static size_t qrcon_lz4hc_compress(const u8 *src, size_t src_size, u8 *dst, size_t dst_size)
+{
+    int ret = LZ4_compress_HC((const char *)src, (char *)dst, src_size, dst_size,
+                              clamp(lz4hc_level, LZ4HC_MIN_CLEVEL, LZ4HC_MAX_CLEVEL),
+                              lz4_workspace);
+
+    return (ret > 0) ? ret : 0;
+}
+
+/* LZ4HC has no fill-to-size mode: start from what plain LZ4 fits, which
+ * HC nearly always beats, and search upwards from there.
+ */
+static size_t qrcon_lz4hc_fill(const u8 *src, size_t src_size, u8 *dst, size_t dst_size,
+                               size_t payload_cap, size_t *processed_size)
+{
+    size_t guess;
+
+    qrcon_lz4_fill(src, src_size, dst, dst_size, payload_cap, &guess);
+    return qrcon_fill_search(qrcon_lz4hc_compress, src, src_size, dst, dst_size,
+                             payload_cap, guess, processed_size);
+}
+
+static const struct qrcon_codec qrcon_codecs[] = {
+    [QRCON_COMPRESS_ZSTD]  = { "zstd",  QRCON_CODEC_ZSTD, qrcon_zstd_fill,  qrcon_zstd_compress },
+    [QRCON_COMPRESS_LZ4]   = { "lz4",   QRCON_CODEC_LZ4,  qrcon_lz4_fill,   qrcon_lz4_compress },
+    [QRCON_COMPRESS_LZ4HC] = { "lz4hc", QRCON_CODEC_LZ4,  qrcon_lz4hc_fill, qrcon_lz4hc_compress },
+};
+
+/* qrcon_compress_fn packing the records with qrcon_records_pack() first */
+static size_t qrcon_records_compress(const u8 *src, size_t src_size, u8 *dst, size_t dst_size)
+{
+    qrcon_record_len = qrcon_records_pack(src, src_size, qrcon_record_buf, sizeof(qrcon_record_buf));
+    if (!qrcon_record_len)
+        return 0;
+    return qrcon_record_codec->compress(qrcon_record_buf, qrcon_record_len, dst, dst_size);
+}
+
+/* Fill a frame with packed records of the history at src.
+ * Return: compressed size, 0 if nothing fits.
+ */
+static size_t qrcon_records_fill(const struct qrcon_codec *codec, const u8 *src, size_t src_size,
+                                 u8 *dst, size_t dst_size, size_t payload_cap,
+                                 size_t *processed_size, size_t *packed_size)
+{
+    size_t size;
+
+    qrcon_record_codec = codec;
+    size = qrcon_fill_search(qrcon_records_compress, src, src_size, dst, dst_size,
+                             payload_cap, 0, processed_size);
+    /* The last attempt is the one left in dst */
+    *packed_size = qrcon_record_len;
+    return size;
 }
 
 /* Compress data to fit within the target QR version capacity.
- * Attempts to compress the entire source buffer.
- * If the compressed data exceeds the capacity for the configured qr_version,
- * it fails and returns 0.
+ * Finds the longest prefix of src whose compressed size (plus header) fits
+ * the capacity for the configured qr_version, using the configured codec.
+ * In QRCON_COMPRESS_BEST mode both zstd and LZ4HC are tried and the one
+ * that fits more input wins.
  * Writes compressed output directly to dst buffer.
  *
  * Return: total compressed size + header, or 0 on failure.
@@ -314,132 +2647,414 @@ static int qrcon_init_compression(void)
 static size_t qrcon_compress_data(const void *src, size_t src_size, void *dst, size_t dst_capacity,
                                  size_t *processed_size)
 {
-    size_t compressed_size;
-    u32 *header = (u32 *)dst;
+    const struct qrcon_codec *codec, *alt = NULL;
+    struct qrcon_frame_header *header = dst;
+    size_t compressed_size = 0, alt_size, alt_processed;
+    size_t packed_size = 0, alt_packed_size = 0;
+    bool records, alt_records;
     size_t target_capacity;
-    int level = compression_level;
     size_t dst_payload_capacity;
-    size_t low, high, mid;
-    size_t best_size = 0; /* Largest src size that fits */
-    size_t best_compressed_payload = 0; /* Size of compressed payload for best_size */
+    size_t payload_cap;
+    int version = qrcon_qr_version();
 
     *processed_size = 0; /* Initialize */
 
     /* Validate qr_version */
-    if (qr_version < 1 || qr_version > 40) {
-        pr_err("qrcon: Invalid qr_version (%d), must be 1-40\n", qr_version);
+    if (version < 1 || version > 40) {
+        pr_err("qrcon: Invalid qr_version (%d), must be 1-40\n", version);
         return 0;
     }
 
     /* Determine target capacity based on the configured version */
-    target_capacity = qr_max_data_size((u8)qr_version, 0);
+    target_capacity = qr_max_data_size((u8)version, (u8)qr_ecc, 0, structured_append);
     if (target_capacity == 0) {
-        pr_err("qrcon: Failed to get capacity for version %u\n", qr_version);
+        pr_err("qrcon: Failed to get capacity for version %u\n", version);
         return 0;
     }
 
+    /* Tiled frames get a number when they are shown, see qrcon_show_payload() */
+    if (qr_tiles != 1)
+        target_capacity -= sizeof(struct qrcon_tile_header);
+
     /* Clamp target_capacity to actual destination buffer size */
     if (target_capacity > dst_capacity) {
         pr_warn("qrcon: Version %u capacity (%zu) exceeds dst buffer (%zu), clamping.\n",
-                qr_version, target_capacity, dst_capacity);
+                version, target_capacity, dst_capacity);
         target_capacity = dst_capacity;
     }
 
     /* Check if destination payload buffer is too small */
     if (target_capacity <= QR_COMPRESSION_HEADER_SIZE) {
-         pr_err("qrcon: Target capacity too small for header (%zu <= %d)\n",
+         pr_err("qrcon: Target capacity too small for header (%zu <= %zu)\n",
                 target_capacity, QR_COMPRESSION_HEADER_SIZE);
         return 0;
     }
-    dst_payload_capacity = target_capacity - QR_COMPRESSION_HEADER_SIZE;
-
-    /* Clamp compression level */
-    if (level < 1)
-        level = 1;
-    else if (level > 22)
-        level = 22;
-
-    /* Binary search for the largest chunk of src that fits target_capacity */
-    low = 1;
-    high = src_size;
-    while (low <= high) {
-        mid = low + (high - low) / 2;
-        if (mid == 0) break; /* Avoid infinite loop if src_size is huge */
-
-        /* Try compressing 'mid' bytes of src */
-        /* Note: We don't need to write the header here yet */
-        compressed_size = ZSTD_compressCCtx(cctx, dst + QR_COMPRESSION_HEADER_SIZE, /* Use dst as temp workspace */
-                                         dst_payload_capacity,
-                                         src, mid, level);
-
-        if (ZSTD_isError(compressed_size)) {
-            /* Compression error likely means 'mid' is too small or data is bad.
-             * Try a smaller chunk, although ideally shouldn't usually happen here. */
-            pr_debug("qrcon: ZSTD err (%s) compressing %zu bytes, trying smaller.\n",
-                    ZSTD_getErrorName(compressed_size), mid);
-            high = mid - 1;
-            continue;
-        }
+    payload_cap = target_capacity - QR_COMPRESSION_HEADER_SIZE;
+    /* Let attempts overshoot into the rest of dst, so their size is known */
+    dst_payload_capacity = dst_capacity - QR_COMPRESSION_HEADER_SIZE;
 
-        /* Check if compressed_size + header fits */
-        if (QR_COMPRESSION_HEADER_SIZE + compressed_size <= target_capacity) {
-            /* This fits. Record it as the best candidate so far.
-             * Try to fit a larger chunk. */
-            best_size = mid;
-            best_compressed_payload = compressed_size;
-            low = mid + 1;
-        } else {
-            /* Too big. Try to fit a smaller chunk. */
-            high = mid - 1;
+    if (src_size == 0)
+        return 0;
+    /* No frame is given more input than the zstd window was sized for */
+    if (src_size > payload_cap * QRCON_FILL_WINDOW_RATIO)
+        src_size = payload_cap * QRCON_FILL_WINDOW_RATIO;
+
+    if (compression_codec == QRCON_COMPRESS_BEST) {
+        codec = &qrcon_codecs[QRCON_COMPRESS_ZSTD];
+        alt = &qrcon_codecs[QRCON_COMPRESS_LZ4HC];
+    } else if (compression_codec >= 0 && compression_codec < ARRAY_SIZE(qrcon_codecs)) {
+        codec = &qrcon_codecs[compression_codec];
+    } else {
+        pr_warn_once("qrcon: Invalid compression_codec %d, using zstd\n", compression_codec);
+        codec = &qrcon_codecs[QRCON_COMPRESS_ZSTD];
+    }
+
+    /* Records can only be packed from the history, where their sequence numbers are known */
+    records = record_transform && (const u8 *)src >= kmsg_history_buf &&
+              (const u8 *)src + src_size <= kmsg_history_buf + kmsg_history_len;
+
+    if (records)
+        compressed_size = qrcon_records_fill(codec, src, src_size, dst + QR_COMPRESSION_HEADER_SIZE,
+                                             dst_payload_capacity, payload_cap,
+                                             processed_size, &packed_size);
+    else
+        compressed_size = codec->fill(src, src_size, dst + QR_COMPRESSION_HEADER_SIZE,
+                                      dst_payload_capacity, payload_cap, processed_size);
+
+    if (alt) {
+        alt_records = records;
+        if (records)
+            alt_size = qrcon_records_fill(alt, src, src_size, qrcon_codec_scratch,
+                                          sizeof(qrcon_codec_scratch), payload_cap,
+                                          &alt_processed, &alt_packed_size);
+        else
+            alt_size = alt->fill(src, src_size, qrcon_codec_scratch, sizeof(qrcon_codec_scratch),
+                                 payload_cap, &alt_processed);
+        /* Keep whichever covers more input, or the smaller one on a tie */
+        if (alt_size && (!compressed_size || alt_processed > *processed_size ||
+                         (alt_processed == *processed_size && alt_size < compressed_size))) {
+            memcpy(dst + QR_COMPRESSION_HEADER_SIZE, qrcon_codec_scratch, alt_size);
+            compressed_size = alt_size;
+            *processed_size = alt_processed;
+            packed_size = alt_packed_size;
+            records = alt_records;
+            codec = alt;
         }
     }
 
     /* Check if we found any size that fits */
-    if (best_size > 0) {
-        /* We found the largest prefix (best_size) that fits.
-         * Now, perform the final compression of exactly best_size bytes. */
-        header[0] = QR_COMPRESSION_MAGIC;
-        header[1] = (u32)best_size; /* Header reflects the *uncompressed* size */
-
-        compressed_size = ZSTD_compressCCtx(cctx, dst + QR_COMPRESSION_HEADER_SIZE,
-                                         dst_payload_capacity,
-                                         src, best_size, level);
-
-        if (ZSTD_isError(compressed_size)) {
-            /* This should ideally not happen if the search worked, but handle it. */
-            pr_err("qrcon: ZSTD err (%s) on final compression of %zu bytes\n",
-                    ZSTD_getErrorName(compressed_size), best_size);
-            return 0; /* Indicate failure */
-        }
-        
-        /* Verify the final compressed size is what we expected from the search */
-        if (compressed_size != best_compressed_payload) {
-            pr_warn("qrcon: Final compressed size %zu != search size %zu\n",
-                    compressed_size, best_compressed_payload);
-            /* Check if it *still* fits */
-            if (QR_COMPRESSION_HEADER_SIZE + compressed_size > target_capacity) {
-                 pr_err("qrcon: Final compressed size %zu unexpectedly overflowed capacity %zu\n",
-                        QR_COMPRESSION_HEADER_SIZE + compressed_size, target_capacity);
-                 return 0;
-            }
-        }
-        
-        *processed_size = best_size;
-        pr_debug("qrcon: Compressed %zu -> %zu bytes (%u%% of V%d capacity %zu) at level %d\n",
-                best_size, QR_COMPRESSION_HEADER_SIZE + compressed_size,
+    if (compressed_size > 0) {
+        header->magic = cpu_to_le32(QRCON_FRAME_MAGIC);
+        /* Header reflects the *uncompressed* size */
+        header->size = cpu_to_le32(records ? packed_size : *processed_size);
+        header->dict_id = cpu_to_le16((cdict && codec->id == QRCON_CODEC_ZSTD) ? QRCON_DICT_ID : 0);
+        header->flags = records ? QRCON_FRAME_RECORDS : 0;
+        if (records && qrcon_pi_active())
+            header->flags |= QRCON_FRAME_PRINTK;
+        if (records && qrcon_trace_active())
+            header->flags |= QRCON_FRAME_TRACE;
+        header->codec = codec->id;
+
+        pr_debug("qrcon: Compressed %zu -> %zu bytes (%u%% of V%d capacity %zu) with %s%s\n",
+                *processed_size, QR_COMPRESSION_HEADER_SIZE + compressed_size,
                 (u32)(((QR_COMPRESSION_HEADER_SIZE + compressed_size) * 100) / target_capacity),
-                qr_version, target_capacity, level);
+                version, target_capacity, codec->name, records ? ", records packed" : "");
 
         return QR_COMPRESSION_HEADER_SIZE + compressed_size;
     } else {
         /* No chunk size (not even 1 byte) could be compressed to fit */
         pr_warn("qrcon: Could not compress any prefix of %zu bytes to fit V%d capacity %zu\n",
-                src_size, qr_version, target_capacity);
+                src_size, version, target_capacity);
         *processed_size = 0;
         return 0;
     }
 }
 
+/* Target payload capacity for the QR version in use, 0 if invalid or not known yet */
+static size_t qrcon_target_capacity(void)
+{
+    int version = qrcon_qr_version();
+
+    if (version < 1 || version > 40)
+        return 0;
+    return qr_max_data_size((u8)version, (u8)qr_ecc, 0, structured_append);
+}
+
+static struct qrcon_ready_frame *qrcon_ready_frame(unsigned int i)
+{
+    return &ready_frames[(ready_head + i) % QRCON_READY_FRAMES];
+}
+
+/* Drop all pre-compressed frames */
+static void qrcon_ready_reset(void)
+{
+    WRITE_ONCE(ready_count, 0);
+    ready_head = 0;
+    precompress_pos = 0;
+    ready_capacity = 0;
+}
+
+/* Drop the oldest frame. Count is published first, so the ring stays
+ * consistent if we are stopped halfway through.
+ */
+static void qrcon_ready_pop(void)
+{
+    WRITE_ONCE(ready_count, ready_count - 1);
+    smp_wmb();
+    ready_head = (ready_head + 1) % QRCON_READY_FRAMES;
+}
+
+/* The first @cut bytes of the history buffer were discarded */
+static void qrcon_ready_rebase(size_t cut)
+{
+    unsigned int i;
+
+    while (ready_count && qrcon_ready_frame(0)->src_off < cut)
+        qrcon_ready_pop();
+    for (i = 0; i < ready_count; i++)
+        qrcon_ready_frame(i)->src_off -= cut;
+    precompress_pos = (precompress_pos > cut) ? precompress_pos - cut : 0;
+}
+
+/* Compress committed history into full frames for the ready ring.
+ * A frame is only kept when it is full, i.e. the data after it did not fit.
+ * The last partial frame is left as the uncommitted tail for the panic path.
+ *
+ * Return: true if more history is waiting to be compressed.
+ */
+static bool qrcon_precompress(void)
+{
+    struct qrcon_ready_frame *frame;
+    size_t capacity = qrcon_target_capacity();
+    size_t history_len = READ_ONCE(kmsg_history_len);
+    size_t remaining, processed, size;
+    int batch;
+
+    if (capacity == 0)
+        return false;
+    if (capacity != ready_capacity) {
+        qrcon_ready_reset();
+        ready_capacity = capacity;
+    }
+
+    for (batch = 0; batch < QRCON_PRECOMPRESS_BATCH; batch++) {
+        if (precompress_pos >= history_len)
+            return false;
+        remaining = history_len - precompress_pos;
+
+        /* Keep the oldest frames when the ring is full: the panic path shows
+         * history from the start, so those are the ones it needs first.
+         * Compression resumes once the history buffer discards some.
+         */
+        if (ready_count == QRCON_READY_FRAMES)
+            return false;
+        frame = qrcon_ready_frame(ready_count);
+
+        size = qrcon_compress_data(kmsg_history_buf + precompress_pos, remaining,
+                                   frame->payload, QRCON_READY_FRAME_SIZE, &processed);
+        if (size == 0 || processed == 0)
+            return false; /* Leave it to the panic path, which knows how to skip */
+        if (processed == remaining)
+            return false; /* Not a full frame yet */
+
+        frame->src_off = precompress_pos;
+        frame->src_len = processed;
+        frame->len = size;
+        smp_wmb();
+        WRITE_ONCE(ready_count, ready_count + 1);
+        precompress_pos += processed;
+        cond_resched();
+    }
+    return true;
+}
+
+/* Move on to the next tile, or leave the screen up for a while once every
+ * tile shows a new code.
+ */
+static void qrcon_next_screen(bool *first_delay)
+{
+    /* In tiled mode, only wait once every tile shows a new code */
+    if (qr_tiles != 1 && qr_width) {
+        struct qrcon_tile_layout tiles;
+
+        if (qrcon_tile_layout(qr_width, &tiles) && ++tile_next < tiles.count)
+            return;
+        tile_next = 0;
+    }
+
+    /* Force framebuffer update to display the finished screen */
+    qrcon_present();
+
+    /* Delay between QR codes */
+    if (*first_delay) {
+        mdelay(2000);
+        *first_delay = false;
+    } else {
+        if (panic_in_progress)
+            mdelay(qr_refresh_delay);
+    }
+}
+
+/* Render the payload in qr_payload_and_image_buf and leave it on screen */
+static void qrcon_render_payload(size_t len, const struct qr_structured_append *append,
+                                 bool *first_delay)
+{
+    /* Set payload length for qr_render_qr */
+    qr_payload_len = len;
+
+    /* Render the QR code */
+    qrcon_render_qr(append);
+    /* qr_payload_and_image_buf is overwritten by qr_generate inside qrcon_render_qr */
+
+    /* In colour mode, only the third code is drawn */
+    if (color_next)
+        return;
+    qrcon_next_screen(first_delay);
+}
+
+/* Show the collected Structured Append series, if any */
+static void qrcon_flush_append(bool *first_delay)
+{
+    struct qr_structured_append append = { .total = append_count };
+    unsigned int i;
+    size_t j;
+
+    for (i = 0; i < append_count; i++) {
+        for (j = 0; j < append_lens[i]; j++)
+            append.parity ^= append_payloads[i][j];
+    }
+
+    for (i = 0; i < append_count; i++) {
+        append.index = i;
+        memcpy(qr_payload_and_image_buf, append_payloads[i], append_lens[i]);
+        qrcon_render_payload(append_lens[i], &append, first_delay);
+    }
+    append_count = 0;
+}
+
+/* Draw the codes left in colour mode, with the missing channels blank */
+static void qrcon_flush_color(bool *first_delay)
+{
+    if (!color_next)
+        return;
+
+    memset(color_planes[color_next], 0,
+           (QRCON_COLOR_PLANES - color_next) * sizeof(color_planes[0]));
+    color_next = 0;
+    qrcon_draw_qr();
+    qrcon_next_screen(first_delay);
+}
+
+/* Blank the tiles left over from the previous screen, and show the last one */
+static void qrcon_flush_tiles(bool *first_delay)
+{
+    struct qrcon_tile_layout tiles;
+    int quiet;
+
+    if (!tile_next || !qrcon_tile_layout(qr_width, &tiles))
+        return;
+
+    quiet = QRCON_TILE_QUIET * tiles.block;
+    for (; tile_next < tiles.count; tile_next++) {
+        qrcon_draw_rect(tiles.x + (tile_next % tiles.cols) * tiles.pitch - quiet,
+                        tiles.y + (tile_next / tiles.cols) * tiles.pitch - quiet,
+                        tiles.pitch + quiet, tiles.pitch + quiet, qrcon_white());
+        shown_width[qrcon_shown_slot(tile_next)] = 0;
+    }
+    tile_next = 0;
+    qrcon_present();
+    mdelay(*first_delay ? 2000 : qr_refresh_delay);
+    *first_delay = false;
+}
+
+/* Show the payload in qr_payload_and_image_buf, or add it to the
+ * Structured Append series, which is shown once full.
+ */
+static void qrcon_show_payload(size_t len, bool *first_delay)
+{
+    struct qrcon_frame_header *header = (void *)qr_payload_and_image_buf;
+    struct qrcon_tile_header *tile = (void *)(header + 1);
+
+    /* Tiled codes are scanned in any order, number them */
+    if (qr_tiles != 1 && !(header->flags & QRCON_FRAME_STREAM)) {
+        memmove(tile + 1, tile, len - sizeof(*header));
+        tile->seq = cpu_to_le16(tile_seq++);
+        header->flags |= QRCON_FRAME_TILE;
+        len += sizeof(*tile);
+    }
+
+    if (!structured_append) {
+        qrcon_render_payload(len, NULL, first_delay);
+        return;
+    }
+
+    memcpy(append_payloads[append_count], qr_payload_and_image_buf, len);
+    append_lens[append_count] = len;
+    if (++append_count == QRCON_APPEND_MAX)
+        qrcon_flush_append(first_delay);
+}
+
+/* Compress the history from kmsg_history_pos as a single zstd frame and show
+ * it as consecutive pieces, each filling a QR code to capacity.
+ */
+static void qrcon_stream_history(size_t target_capacity, bool *first_delay)
+{
+    struct qrcon_frame_header *header = (void *)qr_payload_and_image_buf;
+    struct qrcon_stream_header *stream = (void *)(header + 1);
+    size_t total = kmsg_history_len - kmsg_history_pos;
+    ZSTD_inBuffer in = { kmsg_history_buf + kmsg_history_pos, total, 0 };
+    ZSTD_outBuffer out;
+    size_t offset = 0;
+    size_t ret = 1;
+    u16 seq = 0;
+
+    if (target_capacity <= QRCON_STREAM_HEADER_SIZE) {
+        pr_err("qrcon: Target capacity too small for stream header (%zu <= %zu)\n",
+               target_capacity, QRCON_STREAM_HEADER_SIZE);
+        return;
+    }
+
+    qrcon_zstd_begin(compression_level, &zstd_stream_cparams);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, total);
+
+    while (ret != 0) {
+        out.dst = stream + 1;
+        out.size = target_capacity - QRCON_STREAM_HEADER_SIZE;
+        out.pos = 0;
+
+        /* Fill this piece, unless the frame ends first */
+        while (out.pos < out.size) {
+            ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(ret)) {
+                pr_err("qrcon: Stream compression failed at piece %u: %s\n",
+                       seq, ZSTD_getErrorName(ret));
+                return;
+            }
+            if (ret == 0)
+                break;
+        }
+
+        header->magic = cpu_to_le32(QRCON_FRAME_MAGIC);
+        header->size = cpu_to_le32(total);
+        header->dict_id = cpu_to_le16(cdict ? QRCON_DICT_ID : 0);
+        header->flags = QRCON_FRAME_STREAM | (ret == 0 ? QRCON_FRAME_STREAM_END : 0);
+        header->codec = QRCON_CODEC_ZSTD;
+        stream->seq = cpu_to_le16(seq);
+        stream->offset = cpu_to_le32(offset);
+        stream->id = cpu_to_le16(stream_id);
+
+        pr_debug("qrcon: Stream piece %u: %zu bytes at offset %zu, %zu of %zu bytes consumed\n",
+                 seq, out.pos, offset, in.pos, total);
+
+        qrcon_show_payload(QRCON_STREAM_HEADER_SIZE + out.pos, first_delay);
+        offset += out.pos;
+        seq++;
+    }
+
+    pr_info("qrcon: Streamed %zu bytes as %u QR codes (%zu bytes compressed)\n",
+            total, seq, offset);
+}
+
 static void qrcon_process_history(void)
 {
     size_t remaining;
@@ -447,23 +3062,30 @@ static void qrcon_process_history(void)
     size_t compressed_size = 0; /* Size of the compressed payload */
     bool first_delay = true;
     size_t target_capacity; /* For logging */
+    struct qrcon_ready_frame *frame;
+    unsigned int ready;
+    int version = qrcon_qr_version();
 
     if (kmsg_history_len == 0)
         return;
+    tile_next = 0;
+    tile_seq = 0;
+    color_next = 0;
+    qrcon_forget_shown();
 
     pr_info("qrcon: Processing %zu bytes of historical kernel messages for QR v%d\n",
-            kmsg_history_len, qr_version);
+            kmsg_history_len, version);
 
     /* Validate qr_version here as well, before entering the loop */
-    if (qr_version < 1 || qr_version > 40) {
-        pr_err("qrcon: Invalid qr_version (%d) in process_history. Aborting.\n", qr_version);
+    if (version < 1 || version > 40) {
+        pr_err("qrcon: Invalid qr_version (%d) in process_history. Aborting.\n", version);
         kmsg_history_len = 0; /* Prevent further processing */
         kmsg_history_pos = 0;
         return;
     }
-    target_capacity = qr_max_data_size((u8)qr_version, 0);
+    target_capacity = qr_max_data_size((u8)version, (u8)qr_ecc, 0, structured_append);
     if (target_capacity == 0) {
-         pr_err("qrcon: Failed to get capacity for version %u in process_history. Aborting.\n", qr_version);
+         pr_err("qrcon: Failed to get capacity for version %u in process_history. Aborting.\n", version);
          kmsg_history_len = 0;
          kmsg_history_pos = 0;
          return;
@@ -489,16 +3111,43 @@ static void qrcon_process_history(void)
         kmsg_history_pos = 0; /* Ensure we start from 0 if recent_only is off */
     }
 
-    /* Process the history buffer in chunks matching the entire remaining data */
-    while (kmsg_history_pos < kmsg_history_len) {
-        remaining = kmsg_history_len - kmsg_history_pos;
+    if (stream_mode) {
+        qrcon_stream_history(target_capacity, &first_delay);
+        goto done;
+    }
 
-        /* Attempt to compress the *entire* remaining chunk */
-        compressed_size = qrcon_compress_data(kmsg_history_buf + kmsg_history_pos,
-                                            remaining,
-                                            qr_payload_and_image_buf,
-                                            QR_PAYLOAD_AND_IMAGE_BUF_SIZE,
-                                            &processed_src);
+    /* Ready frames are only usable if built for the same capacity */
+    if (ready_count && ready_capacity != target_capacity) {
+        pr_warn("qrcon: Discarding %u ready frames built for another capacity\n", ready_count);
+        qrcon_ready_reset();
+    }
+    pr_info("qrcon: %u pre-compressed frames ready, covering up to offset %zu\n",
+            ready_count, precompress_pos);
+
+    /* Process the history buffer, using ready frames where available */
+    ready = 0;
+    while (kmsg_history_pos < kmsg_history_len) {
+        /* Skip ready frames that start before the current position */
+        while (ready < ready_count && qrcon_ready_frame(ready)->src_off < kmsg_history_pos)
+            ready++;
+        frame = (ready < ready_count) ? qrcon_ready_frame(ready) : NULL;
+
+        if (frame && frame->src_off == kmsg_history_pos) {
+            memcpy(qr_payload_and_image_buf, frame->payload, frame->len);
+            compressed_size = frame->len;
+            processed_src = frame->src_len;
+            remaining = frame->src_len;
+            ready++;
+        } else {
+            /* Compress up to the next ready frame, or the end of history */
+            remaining = (frame ? frame->src_off : kmsg_history_len) - kmsg_history_pos;
+
+            compressed_size = qrcon_compress_data(kmsg_history_buf + kmsg_history_pos,
+                                                remaining,
+                                                qr_payload_and_image_buf,
+                                                QR_PAYLOAD_AND_IMAGE_BUF_SIZE,
+                                                &processed_src);
+        }
 
         if (compressed_size == 0) {
             /* Compression failed OR no prefix fit the capacity.
@@ -506,39 +3155,191 @@ static void qrcon_process_history(void)
              * processed_src should be 0 in this case from qrcon_compress_data. */
             size_t skip_amount = (remaining < QR_SKIP_SIZE) ? remaining : QR_SKIP_SIZE;
             pr_err("qrcon: Skipping %zu bytes of history data after compression failure/overflow for QR v%d\n",
-                   skip_amount, qr_version);
+                   skip_amount, version);
             kmsg_history_pos += skip_amount;
             continue; /* Try compressing the next chunk */
         }
 
-        /* Set payload length for qr_render_qr */
-        qr_payload_len = compressed_size;
-
-        /* Render the QR code */
-        qrcon_render_qr();
-        /* Payload length is implicitly reset/ignored on next loop iteration */
-        /* qr_payload_and_image_buf is overwritten by qr_generate inside qrcon_render_qr */
+        qrcon_show_payload(compressed_size, &first_delay);
 
         kmsg_history_pos += processed_src; /* Advance by the amount successfully processed */
-
-        /* Delay between QR codes */
-        if (first_delay) {
-            mdelay(2000);
-            first_delay = false;
-        } else {
-            if (panic_in_progress)
-                mdelay(qr_refresh_delay);
-        }
     }
+
+done:
+    /* The last series may not be full, nor the last screen of tiles */
+    qrcon_flush_append(&first_delay);
+    qrcon_flush_color(&first_delay);
+    qrcon_flush_tiles(&first_delay);
     mdelay(1000); // Small delay before framebuffer console overwrites the final QR code    
     pr_info("qrcon: Completed processing historical kernel messages\n");
     
     /* Reset history data state after processing */
     kmsg_history_len = 0;
     kmsg_history_pos = 0;
+    qrcon_ready_reset();
+    qrcon_seq_reset();
     qr_payload_len = 0; /* Ensure payload length is zero after finishing */
 }
 
+/* Discard the first @cut bytes of the history buffer, a line boundary */
+static void qrcon_history_discard(size_t cut)
+{
+    pr_warn_once("qrcon: kmsg history buffer full, discarding oldest logs\n");
+    /* Sequence numbers are counted on the lines still in place */
+    qrcon_seq_rebase(cut);
+    line_refs_off = SIZE_MAX;
+    qrcon_ready_rebase(cut);
+    memmove(kmsg_history_buf, kmsg_history_buf + cut, kmsg_history_len - cut);
+    kmsg_history_len -= cut;
+}
+
+/* Append one syslog-formatted record with sequence number @seq to the
+ * history buffer. When the buffer is full, the oldest half is discarded
+ * (cut at a line boundary) so the records leading up to the panic are
+ * always kept.
+ */
+static void qrcon_history_append(const char *line, size_t len, u64 seq)
+{
+    const char *p, *end = line + len - 1;
+    unsigned int anchors = 0;
+    size_t cut;
+
+    if (len >= KMSG_HISTORY_BUF_SIZE / 2)
+        return;
+
+    if (kmsg_history_len + len > KMSG_HISTORY_BUF_SIZE) {
+        cut = KMSG_HISTORY_BUF_SIZE / 2;
+        while (cut < kmsg_history_len && kmsg_history_buf[cut - 1] != '\n')
+            cut++;
+        qrcon_history_discard(cut);
+    }
+
+    /* Out of anchors: discard the history of the oldest half of them */
+    if (!seq_anchor_count || seq != history_next_seq)
+        anchors++;
+    for (p = line; p < end && (p = memchr(p, '\n', end - p)); p++)
+        anchors++;
+    if (seq_anchor_count + anchors > QRCON_SEQ_ANCHORS)
+        qrcon_history_discard(seq_anchors[QRCON_SEQ_ANCHORS / 2].off);
+
+    /* Records were dropped before this one, or it is the first */
+    if (!seq_anchor_count || seq != history_next_seq)
+        qrcon_seq_anchor(kmsg_history_len, seq);
+    /* Every further line of a multi-line record carries the same number */
+    for (p = line; p < end && (p = memchr(p, '\n', end - p)); p++)
+        qrcon_seq_anchor(kmsg_history_len + (p + 1 - line), seq);
+    history_next_seq = seq + 1;
+
+    memcpy(kmsg_history_buf + kmsg_history_len, line, len);
+    /* Publish the length only once the record is in place */
+    smp_wmb();
+    WRITE_ONCE(kmsg_history_len, kmsg_history_len + len);
+}
+
+/* Copy all records from @iter onwards into the history buffer.
+ * Return: number of records copied.
+ */
+static size_t qrcon_capture_drain(struct kmsg_dump_iter *iter, char *line_buf, size_t line_size)
+{
+    size_t len, count = 0;
+
+    while (kmsg_dump_get_line(iter, true, line_buf, line_size - 1, &len)) {
+        if (len == 0)
+            break;
+        /* cur_seq has moved just past the record that was read */
+        qrcon_history_append(line_buf, len, iter->cur_seq - 1);
+        WRITE_ONCE(capture_next_seq, iter->cur_seq);
+        count++;
+    }
+    return count;
+}
+
+/* Periodically mirror new kmsg records into the history buffer,
+ * then compress whatever full frames they make up.
+ */
+static void qrcon_capture_workfn(struct work_struct *work)
+{
+#ifdef QRCON_FBDEV
+    struct fb_info *info;
+#endif
+    bool backlog = false;
+
+    if (READ_ONCE(panic_in_progress))
+        return;
+
+    WRITE_ONCE(capture_busy, true);
+    smp_wmb();
+    qrcon_capture_drain(&capture_iter, capture_line_buf, sizeof(capture_line_buf));
+    smp_wmb();
+    WRITE_ONCE(capture_busy, false);
+
+#ifdef QRCON_DRM_PANIC
+    qrcon_find_drm();
+#endif
+#ifdef QRCON_FBDEV
+    /* Auto mode sizes frames for fb0, which may only be registered later */
+    info = READ_ONCE(registered_fb[0]);
+    if (info)
+        qrcon_update_auto_version(&info->var);
+#endif
+#if defined(QRCON_FIRMWARE_FB) && defined(QRCON_FBDEV)
+    /* Once a driver owns the display, its memory may be reused for anything,
+     * so the firmware framebuffer is no longer drawn on. DRM devices are
+     * caught by qrcon_find_drm(), handoffs by qrcon_platform_notify().
+     */
+    if (info)
+        WRITE_ONCE(fw_fb_retired, true);
+#endif
+
+    /* Stream mode compresses everything in one go at panic */
+    if (precompress && !stream_mode) {
+        WRITE_ONCE(precompress_busy, true);
+        smp_wmb();
+        backlog = qrcon_precompress();
+        smp_wmb();
+        WRITE_ONCE(precompress_busy, false);
+    }
+
+    /* Come back right away while there is compression backlog */
+    queue_delayed_work(qrcon_wq, &capture_work,
+                       backlog ? 1 : msecs_to_jiffies(capture_interval));
+}
+
+/* Start mirroring kmsg from the oldest record still in the printk buffer */
+static int qrcon_capture_init(void)
+{
+    if (!runtime_capture)
+        return 0;
+
+    if (capture_interval < 10)
+        capture_interval = 10;
+
+    qrcon_wq = alloc_ordered_workqueue("qrcon", 0);
+    if (!qrcon_wq) {
+        pr_err("qrcon: Failed to allocate capture workqueue\n");
+        return -ENOMEM;
+    }
+
+    kmsg_dump_rewind(&capture_iter);
+    INIT_DELAYED_WORK(&capture_work, qrcon_capture_workfn);
+    capture_started = true;
+    queue_delayed_work(qrcon_wq, &capture_work, 0);
+
+    pr_info("qrcon: Runtime capture enabled, draining kmsg every %d ms\n", capture_interval);
+    return 0;
+}
+
+static void qrcon_capture_exit(void)
+{
+    if (!capture_started)
+        return;
+
+    capture_started = false;
+    cancel_delayed_work_sync(&capture_work);
+    destroy_workqueue(qrcon_wq);
+    qrcon_wq = NULL;
+}
+
 /* Refactored qrcon_panic_notifier to capture panic messages by accumulating extra log lines */
 static int qrcon_panic_notifier(struct notifier_block *nb, unsigned long event, void *buf)
 {
@@ -552,6 +3353,18 @@ static int qrcon_panic_notifier(struct notifier_block *nb, unsigned long event,
 
     panic_in_progress = true;
 
+    /* The compression context may have been left mid-frame by the work item */
+    if (READ_ONCE(precompress_busy)) {
+        pr_warn("qrcon: Pre-compression interrupted, resetting compression context\n");
+        if (qrcon_init_compression() < 0) {
+            panic_in_progress = false;
+            return NOTIFY_DONE;
+        }
+        /* It may also have been storing lookups, which are only a cache */
+        seq_cursor.off = SIZE_MAX;
+        line_refs_off = SIZE_MAX;
+    }
+
     /* Try opening framebuffer, if it didn't init before panic, nothing will. */
     ret = qrcon_open_fb();
     if (ret < 0) {
@@ -579,33 +3392,33 @@ static int qrcon_panic_notifier(struct notifier_block *nb, unsigned long event,
          }
     }
 
-    /* Accumulate additional kernel messages from the log to capture panic messages */
+    /* Collect the records that are not in the history buffer yet */
     {
          struct kmsg_dump_iter iter;
          /* Use a static temporary buffer to avoid stack overflow */
          static char temp_line_buf[QR_PAYLOAD_AND_IMAGE_BUF_SIZE];
-         size_t len;
+
          kmsg_dump_rewind(&iter);
-         /* Read lines until buffer is full or no more lines */
-         while (kmsg_history_len < KMSG_HISTORY_BUF_SIZE && 
-                kmsg_dump_get_line(&iter, true, temp_line_buf, sizeof(temp_line_buf) - 1, &len)) 
-         {
-              if (len == 0)
-                  break;
-              /* Check if the new line fits */
-              if (kmsg_history_len + len < KMSG_HISTORY_BUF_SIZE) {
-                  memcpy(kmsg_history_buf + kmsg_history_len, temp_line_buf, len);
-                  kmsg_history_len += len;
-              } else {
-                  /* Buffer full */
-                  pr_warn("qrcon: kmsg history buffer full during panic, discarding remaining logs\n");
-                  break; 
-              }
+         if (capture_started && !READ_ONCE(capture_busy)) {
+             /* Runtime capture already holds everything before capture_next_seq */
+             if (iter.cur_seq < capture_next_seq)
+                 iter.cur_seq = capture_next_seq;
+         } else {
+             /* No runtime capture, or it was interrupted mid-update: copy everything */
+             if (capture_started)
+                 pr_warn("qrcon: Runtime capture interrupted, recollecting full history\n");
+             kmsg_history_len = 0;
+             qrcon_ready_reset();
+             qrcon_seq_reset();
          }
+         pr_debug("qrcon: %zu bytes captured at runtime, collecting from seq %llu\n",
+                  kmsg_history_len, iter.cur_seq);
+         qrcon_capture_drain(&iter, temp_line_buf, sizeof(temp_line_buf));
     }
     
     /* Process all accumulated kernel messages uniformly as QR codes */
     qrcon_process_history();
+    qrcon_close_fb();
     pr_info("qrcon: Processed all dumped kernel messages as QR codes\n");
 
     panic_rendering_complete = true;
@@ -635,8 +3448,17 @@ static int __init qrcon_init(void)
         return ret;
     }
     
+    qrcon_init_printk_index();
+    qrcon_init_shown();
+#ifdef QRCON_FIRMWARE_FB
+    qrcon_map_firmware_fb();
+#endif
+    /* After the firmware framebuffer, which may pick the version in auto mode */
+    qr_generator_init(qrcon_qr_version(), qr_ecc);
+
     /* Initialize buffer */
     qr_payload_len = 0;
+    stream_id = get_random_u32();
 
     /* Register panic notifier */
     ret = atomic_notifier_chain_register(&panic_notifier_list, &panic_nb);
@@ -645,6 +3467,11 @@ static int __init qrcon_init(void)
         return ret;
     }
 
+    /* Runtime capture is optional, panic falls back to a full copy without it */
+    ret = qrcon_capture_init();
+    if (ret < 0)
+        pr_warn("qrcon: Runtime capture unavailable, history will be copied at panic\n");
+
     qrcon_initialized = true;
 
     pr_info("qrcon: Module loaded, panic notifier registered successfully\n");
@@ -654,7 +3481,17 @@ static int __init qrcon_init(void)
 static void __exit qrcon_exit(void)
 {
     qrcon_initialized = false;
+    qrcon_capture_exit();
     atomic_notifier_chain_unregister(&panic_notifier_list, &panic_nb);
+#ifdef QRCON_DRM_PANIC
+    if (drm_dev)
+        drm_dev_put(drm_dev);
+#endif
+#ifdef QRCON_FIRMWARE_FB
+    qrcon_unmap_firmware_fb();
+#endif
+    qrcon_exit_printk_index();
+    kvfree(shown_planes);
     pr_info("qrcon: Module exit\n");
 }
 
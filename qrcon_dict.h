@@ -0,0 +1,15 @@
+/*
+ * qrcon_dict.h - Built-in zstd dictionary for qrcon payloads
+ *
+ * Generated by train_dict.py. The default has no dictionary; run
+ * ./train_dict.py on a set of dmesg captures to replace this file, and keep
+ * the matching qrcon.dict next to decode.py.
+ */
+
+#ifndef _QRCON_DICT_H
+#define _QRCON_DICT_H
+
+#define QRCON_DICT_ID 0
+#define QRCON_DICT_SIZE 0
+
+#endif /* _QRCON_DICT_H */
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Split photos or screenshots of qrcon's colour mode into its three codes.
+
+With qr_color set, every frame carries one code in each of the red, green and
+blue channels, which ordinary scanners read as noise. This separates the
+channels into greyscale images:
+
+  ./split_rgb.py IMG_0001.jpg IMG_0002.jpg ...
+
+writes IMG_0001_red.png, IMG_0001_green.png and IMG_0001_blue.png next to
+each input, ready for any scanner. If zxing-cpp (pip install zxing-cpp) or
+pyzbar is installed, the codes are also read straight away and their payloads
+written as hex, one per line, in the order they were shown:
+
+  ./split_rgb.py -o codes.txt IMG_*.jpg && ./decode.py codes.txt
+
+Needs Pillow (pip install pillow, or pkg install python-pillow on Termux).
+"""
+import argparse
+import binascii
+import os
+import sys
+
+try:
+    from PIL import Image, ImageOps
+except ImportError:
+    sys.exit("Error: Pillow is required, pip install pillow")
+
+CHANNELS = ("red", "green", "blue")  # Order the module fills them in
+CUTOFF = 1  # Percent of the darkest and lightest pixels ignored when stretching
+
+
+def split_channels(image):
+    """Return one greyscale image per channel, dark modules black. Camera
+    sensors leak some of each colour into the other channels, so every
+    channel is stretched to the full range before it is handed to a
+    scanner, which binarizes it itself."""
+    return [ImageOps.autocontrast(plane, cutoff=CUTOFF) for plane in image.convert("RGB").split()]
+
+
+def find_reader():
+    """Return a function reading the payloads of all codes in an image, or None."""
+    try:
+        import zxingcpp
+
+        def read(image):
+            results = zxingcpp.read_barcodes(image, formats=zxingcpp.BarcodeFormat.QRCode)
+            results.sort(key=lambda r: (r.position.top_left.y, r.position.top_left.x))
+            return [bytes(r.bytes) for r in results]
+        return read
+    except ImportError:
+        pass
+    try:
+        from pyzbar import pyzbar
+
+        def read(image):
+            results = pyzbar.decode(image, symbols=[pyzbar.ZBarSymbol.QRCODE])
+            results.sort(key=lambda r: (r.rect.top, r.rect.left))
+            return [r.data for r in results]
+        return read
+    except ImportError:
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("images", nargs="+", help="photos or screenshots, in the order they were taken")
+    parser.add_argument("-o", "--output", help="write payloads as hex to this file instead of stdout")
+    parser.add_argument("--no-save", action="store_true", help="do not write the channel images")
+    args = parser.parse_args()
+
+    read = find_reader()
+    if not read:
+        print("zxing-cpp or pyzbar not found, only writing channel images", file=sys.stderr)
+
+    payloads = []
+    for path in args.images:
+        with Image.open(path) as image:
+            planes = split_channels(image)
+        base = os.path.splitext(path)[0]
+        for name, plane in zip(CHANNELS, planes):
+            if not args.no_save:
+                plane.save(f"{base}_{name}.png")
+            if read:
+                found = read(plane)
+                print(f"{path}: {len(found)} codes in {name}", file=sys.stderr)
+                payloads.extend(found)
+
+    if not read:
+        return
+    text = ''.join(binascii.hexlify(p).decode() + '\n' for p in payloads)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
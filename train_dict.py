@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Train the built-in zstd dictionary for qrcon.
+
+Splits dmesg captures into samples the size of one QR payload, trains a
+dictionary on them with the zstd CLI and writes:
+
+  qrcon.dict     - raw dictionary, loaded by decode.py
+  qrcon_dict.h   - the same dictionary as a C array, built into the module
+
+Captures should be in the format qrcon compresses ("<level>[time] text"),
+e.g. `dmesg -r` output, or the logs written by decode.py.
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+ANSI_RE = re.compile(r'\x1b\[[0-9;]*m')
+SAMPLE_SIZE = 8192      # Roughly the log text that fills one V20-L payload (858 bytes) once compressed
+DICT_SIZE = 4096        # Must fit next to the compression context in the module
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def load_samples(paths, sample_size):
+    """Read captures, strip colors and cut them into samples at line boundaries."""
+    samples = []
+    for path in paths:
+        with open(path, 'rb') as f:
+            text = ANSI_RE.sub('', f.read().decode('utf-8', errors='replace'))
+        chunk = []
+        chunk_len = 0
+        for line in text.splitlines(keepends=True):
+            chunk.append(line)
+            chunk_len += len(line)
+            if chunk_len >= sample_size:
+                samples.append(''.join(chunk).encode())
+                chunk, chunk_len = [], 0
+        if chunk:
+            samples.append(''.join(chunk).encode())
+    return samples
+
+
+def write_header(path, dict_data, dict_id):
+    with open(path, 'w') as f:
+        f.write("/*\n"
+                " * qrcon_dict.h - Built-in zstd dictionary for qrcon payloads\n"
+                " *\n"
+                " * Generated by train_dict.py, do not edit. The matching qrcon.dict\n"
+                " * must be next to decode.py (or in $QRCON_DICT) to decode frames.\n"
+                " */\n\n"
+                "#ifndef _QRCON_DICT_H\n"
+                "#define _QRCON_DICT_H\n\n")
+        f.write(f"#define QRCON_DICT_ID {dict_id}\n")
+        f.write(f"#define QRCON_DICT_SIZE {len(dict_data)}\n\n")
+        f.write("static const u8 qrcon_dict[QRCON_DICT_SIZE] = {\n")
+        for i in range(0, len(dict_data), 12):
+            row = ', '.join(f"0x{b:02x}" for b in dict_data[i:i + 12])
+            f.write(f"\t{row},\n")
+        f.write("};\n\n#endif /* _QRCON_DICT_H */\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Train the qrcon zstd dictionary from dmesg captures.")
+    parser.add_argument('captures', nargs='+', help="dmesg capture files")
+    parser.add_argument('--dict-id', type=int, required=True,
+                        help="dictionary ID (1-65535), bump it whenever the dictionary changes")
+    parser.add_argument('--maxdict', type=int, default=DICT_SIZE, help="dictionary size in bytes")
+    parser.add_argument('--sample-size', type=int, default=SAMPLE_SIZE, help="bytes of log per sample")
+    parser.add_argument('--out-dir', default=HERE, help="where to write qrcon.dict and qrcon_dict.h")
+    args = parser.parse_args()
+
+    # The frame header only has 16 bits for it, and 0 means no dictionary
+    if not 1 <= args.dict_id <= 0xFFFF:
+        sys.exit("Error: --dict-id must be between 1 and 65535")
+
+    samples = load_samples(args.captures, args.sample_size)
+    if len(samples) < 8:
+        sys.exit(f"Error: only {len(samples)} samples, provide more captures")
+    print(f"Training on {len(samples)} samples ({sum(map(len, samples))} bytes)")
+
+    dict_path = os.path.join(args.out_dir, "qrcon.dict")
+    with tempfile.TemporaryDirectory() as tmp:
+        sample_paths = []
+        for i, sample in enumerate(samples):
+            sample_path = os.path.join(tmp, f"{i:06d}")
+            with open(sample_path, 'wb') as f:
+                f.write(sample)
+            sample_paths.append(sample_path)
+        try:
+            subprocess.run(["zstd", "--train", "-q", f"--maxdict={args.maxdict}",
+                            f"--dictID={args.dict_id}", "-o", dict_path] + sample_paths,
+                           check=True)
+        except FileNotFoundError:
+            sys.exit("Error: 'zstd' command not found. Please install zstd to train a dictionary.")
+        except subprocess.CalledProcessError as e:
+            sys.exit(f"Error: dictionary training failed: {e}")
+
+    with open(dict_path, 'rb') as f:
+        dict_data = f.read()
+    write_header(os.path.join(args.out_dir, "qrcon_dict.h"), dict_data, args.dict_id)
+    print(f"Wrote {dict_path} and qrcon_dict.h ({len(dict_data)} bytes, ID {args.dict_id})")
+
+
+if __name__ == "__main__":
+    main()